@@ -36,14 +36,22 @@ static void print_usage() {
 	printf(
 			"Usage: pvlib [options] MAC PASSWORD\n"
 			"Options:\n"
+			"-c <connection> connection to use, default rfcomm.\n"
+			"-a <adapter> bluetooth adapter index or mac for rfcomm.\n"
+			"-q <size> receive queue size in packets.\n"
+			"-b stop reading while the receive queue is full instead of dropping.\n"
+			"-n no receive thread, read inline.\n"
+			"-k <seconds> keep the link alive after seconds idle.\n"
 			"-d <module> modules logging should be enabled for.\n"
 			"-l <severity> log severity can be error, warning, info, debug, trace.\n"
 			"-s read spot data\n"
 			"-e read event archive\n"
 			"-y read day archive\n"
 			"-i read inverter info\n"
+			"-t print bluetooth nodes with signal strength\n"
 			"\n"
-			"Example: pvlib \"00:11:22:33:44:55\" \"0000\"\n");
+			"Example: pvlib \"00:11:22:33:44:55\" \"0000\"\n"
+			"         pvlib -c sim 1 \"0000\"\n");
 }
 
 static void log_callback(const char *module, const char *filename, int line, pvlib_log_level level, const char *message) {
@@ -191,6 +199,14 @@ int main(int argc, char **argv) {
 	bool readEventArchive = false;
 	bool readDayArchive = false;
 	bool readInverterInfo = false;
+	const char *connection = "rfcomm";
+	pvlib_rfcomm_param rfcommParam = { PVLIB_RFCOMM_REMOTE_NAME_BACKGROUND, NULL };
+	const void *conParam = NULL;
+	pvlib_smadata2plus_param protParam;
+	bool linkStats = false;
+	bool readTopology = false;
+
+	memset(&protParam, 0, sizeof(protParam));
 
 
 	const char *modules[MAX_LOG_MODULES];
@@ -199,8 +215,33 @@ int main(int argc, char **argv) {
 	int log_modules = 0;
 	int c;
 	pvlib_log_level log_level = PVLIB_LOG_WARNING;
-	while ((c = getopt(argc, argv, "d:l:seyi")) != -1) {
+	while ((c = getopt(argc, argv, "a:bc:d:k:l:nq:seyit")) != -1) {
 		switch (c) {
+		case 'a':
+			rfcommParam.adapter = optarg;
+			conParam = &rfcommParam;
+			break;
+		case 'b':
+			protParam.backpressure = 1;
+			linkStats = true;
+			break;
+		case 'c':
+			connection = optarg;
+			break;
+		case 'n':
+			protParam.inline_io = 1;
+			break;
+		case 'k':
+			protParam.keepalive = atoi(optarg);
+			linkStats = true;
+			break;
+		case 't':
+			readTopology = true;
+			break;
+		case 'q':
+			protParam.queue_size = atoi(optarg);
+			linkStats = true;
+			break;
 		case 'd':
 			modules[log_modules++] = optarg;
 			break;
@@ -250,14 +291,14 @@ int main(int argc, char **argv) {
 
 	found = 0;
 	for (i = 0; i < con_num; i++) {
-		if (strcmp(pvlib_connection_name(con_handles[i]), "rfcomm") == 0) {
+		if (strcmp(pvlib_connection_name(con_handles[i]), connection) == 0) {
 			found = 1;
 			break;
 		}
 	}
 
 	if (!found) {
-		fprintf(stderr, "connection rfcomm not available!\n");
+		fprintf(stderr, "connection %s not available!\n", connection);
 		return EXIT_FAILURE;
 	}
 
@@ -286,11 +327,24 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	if (pvlib_connect(plant, argv[optind], argv[optind + 1], NULL, NULL) < 0) {
+	if (strcmp(connection, "rfcomm") != 0) {
+		conParam = NULL;
+	}
+
+	if (pvlib_connect(plant, argv[optind], argv[optind + 1], conParam, &protParam) < 0) {
 		fprintf(stderr, "Failed connecting with plant!\n");
 		return EXIT_FAILURE;
 	}
 
+	if (readTopology) {
+		pvlib_bluetooth_node nodes[16];
+		int num = pvlib_get_bluetooth_nodes(plant, nodes, 16, 60);
+		for (int i = 0; i < num && i < 16; ++i) {
+			const uint8_t *m = nodes[i].mac;
+			printf("node %02X:%02X:%02X:%02X:%02X:%02X signal %d%%\n", m[5], m[4], m[3], m[2], m[1], m[0], nodes[i].signal);
+		}
+	}
+
 	inv_num = pvlib_num_string_inverter(plant);
 
 	if (inv_num <= 0) {
@@ -335,6 +389,19 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (linkStats) {
+		pvlib_link_stats stats;
+		if (pvlib_get_link_stats(plant, &stats) == 0) {
+			printf("link: queue size %u, high watermark %u, dropped %llu, stalled %llu, wakeups %llu\n",
+					stats.queue_size, stats.high_watermark,
+					(unsigned long long)stats.dropped, (unsigned long long)stats.stalled,
+					(unsigned long long)stats.wakeups);
+			printf("keepalive: sent %llu, missed %llu, reconnects avoided %llu\n",
+					(unsigned long long)stats.keepalives, (unsigned long long)stats.keepalives_missed,
+					(unsigned long long)stats.reconnects_avoided);
+		}
+	}
+
 	// Close pvlib
 	pvlib_close(plant);
 	pvlib_shutdown();
@@ -0,0 +1,316 @@
+/*
+ *   Pvlib - Capture recording and replay
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "capture"
+
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+
+#include "byte.h"
+#include "capture.h"
+#include "log.h"
+#include "pvlib.h"
+
+namespace pvlib {
+
+using namespace capture;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+
+const static int TIMEOUT = 5; /* in milliseconds */
+
+static const char MAGIC[6] = { 'P', 'V', 'C', 'A', 'P', '\0' };
+static const uint8_t VERSION = 1;
+static const int RECORD_HEADER_SIZE = 7;
+
+Recorder::Recorder(Connection *con, const std::string &file) :
+		con(con),
+		out(file, std::ios::binary | std::ios::trunc),
+		last(Clock::now()) {
+	if (!out.is_open()) {
+		LOG(Error) << "Could not open capture file: " << file;
+		return;
+	}
+
+	uint8_t header[8];
+	memcpy(header, MAGIC, sizeof(MAGIC));
+	header[6] = VERSION;
+	header[7] = 0;
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	LOG(Info) << "Recording connection to " << file;
+}
+
+Recorder::~Recorder() {
+	delete con;
+}
+
+void Recorder::record(RecordType type, const uint8_t *data, int len) {
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	recordv(type, &iov, 1);
+}
+
+//segments are joined into one record
+void Recorder::recordv(RecordType type, const struct iovec *iov, int iovcnt) {
+	uint8_t header[RECORD_HEADER_SIZE];
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt; ++i) {
+		total += iov[i].iov_len;
+	}
+
+	LockGuard lock(mutex);
+	if (!out.good()) {
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	auto delay = std::chrono::duration_cast<microseconds>(now - last).count();
+	last = now;
+
+	size_t left = std::min<size_t>(total, std::numeric_limits<uint16_t>::max());
+	header[0] = static_cast<uint8_t>(type);
+	byte::storeU32le(header + 1, static_cast<uint32_t>(std::min<int64_t>(delay, UINT32_MAX)));
+	byte::storeU16le(header + 5, static_cast<uint16_t>(left));
+
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+	for (int i = 0; i < iovcnt && left > 0; ++i) {
+		size_t len = std::min(left, iov[i].iov_len);
+		out.write(static_cast<const char*>(iov[i].iov_base), len);
+		left -= len;
+	}
+	out.flush();
+}
+
+int Recorder::connect(const char *address, const void *param) {
+	//the wrapped connection reports a missing address
+	int len = (address != nullptr) ? strlen(address) : 0;
+	record(CONNECT, reinterpret_cast<const uint8_t*>(address), len);
+	return con->connect(address, param);
+}
+
+void Recorder::disconnect() {
+	con->disconnect();
+	record(DISCONNECT, nullptr, 0);
+}
+
+int Recorder::write(const uint8_t *data, int len, const std::string &to) {
+	record(WRITE, data, len);
+	return con->write(data, len, to);
+}
+
+int Recorder::writev(const struct iovec *iov, int iovcnt, const std::string &to) {
+	recordv(WRITE, iov, iovcnt);
+	return con->writev(iov, iovcnt, to);
+}
+
+int Recorder::read(uint8_t *data, int max_len, std::string &from) {
+	int ret = con->read(data, max_len, from);
+	if (ret > 0) {
+		record(READ, data, ret);
+	}
+	return ret;
+}
+
+Replay::Replay() :
+		pos(0),
+		readPos(0),
+		unmatchedWrites(0),
+		connected(false),
+		interrupted(false),
+		realtime(false),
+		timeout(TIMEOUT) {
+
+}
+
+int Replay::load(const std::string &file) {
+	std::ifstream in(file, std::ios::binary);
+	uint8_t header[8];
+
+	if (!in.is_open()) {
+		LOG(Error) << "Could not open capture file: " << file;
+		return -1;
+	}
+
+	in.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!in || memcmp(header, MAGIC, sizeof(MAGIC)) != 0 || header[6] != VERSION) {
+		LOG(Error) << "Invalid capture file: " << file;
+		return -1;
+	}
+
+	records.clear();
+	for (;;) {
+		uint8_t buf[RECORD_HEADER_SIZE];
+		Record r;
+
+		in.read(reinterpret_cast<char*>(buf), sizeof(buf));
+		if (in.gcount() == 0) {
+			break;
+		} else if (!in) {
+			LOG(Warning) << "Truncated capture file: " << file;
+			break;
+		}
+
+		r.type = static_cast<RecordType>(buf[0]);
+		r.delay = byte::parseU32le(buf + 1);
+		r.data.resize(byte::parseU16le(buf + 5));
+		in.read(reinterpret_cast<char*>(r.data.data()), r.data.size());
+		if (!in) {
+			LOG(Warning) << "Truncated capture file: " << file;
+			break;
+		}
+
+		records.push_back(std::move(r));
+	}
+
+	this->file = file;
+	pos = 0;
+	LOG(Info) << "Loaded " << records.size() << " records from " << file;
+
+	return 0;
+}
+
+int Replay::connect(const char *address, const void *param) {
+	const pvlib_replay_param *p = static_cast<const pvlib_replay_param*>(param);
+
+	LockGuard lock(mutex);
+	if (records.empty() || file != address) {
+		if (load(address) < 0) {
+			return -1;
+		}
+	}
+
+	//continue after the next recorded connect
+	while (pos < records.size() && records[pos].type != CONNECT) {
+		++pos;
+	}
+	if (pos >= records.size()) {
+		LOG(Error) << "No more connections in capture file: " << file;
+		return -1;
+	}
+	++pos;
+
+	realtime = (p != nullptr) && (p->realtime != 0);
+	readPos = 0;
+	unmatchedWrites = 0;
+	lastEvent = Clock::now();
+	connected = true;
+
+	return 0;
+}
+
+void Replay::disconnect() {
+	LockGuard lock(mutex);
+	connected = false;
+	event.notify_all();
+}
+
+void Replay::consume() {
+	lastEvent = Clock::now();
+	readPos = 0;
+	++pos;
+
+	//writes done earlier than recorded
+	while (unmatchedWrites > 0 && pos < records.size() && records[pos].type == WRITE) {
+		--unmatchedWrites;
+		++pos;
+	}
+}
+
+int Replay::write(const uint8_t *data, int len, const std::string &to) {
+	LockGuard lock(mutex);
+
+	if (!connected) {
+		return -1;
+	}
+
+	if (pos < records.size() && records[pos].type == WRITE) {
+		const std::vector<uint8_t> &recorded = records[pos].data;
+		if (recorded.size() != static_cast<size_t>(len) || memcmp(recorded.data(), data, len) != 0) {
+			LOG(Debug) << "Write differs from capture:\n" << print_array(data, len);
+		}
+		consume();
+	} else {
+		LOG(Debug) << "Write without capture record:\n" << print_array(data, len);
+		++unmatchedWrites;
+	}
+
+	event.notify_all();
+	return len;
+}
+
+int Replay::read(uint8_t *data, int max_len, std::string &from) {
+	UniqueLock lock(mutex);
+
+	Clock::time_point deadline = Clock::now() + milliseconds(timeout);
+	for (;;) {
+		if (!connected) {
+			return -1;
+		}
+		if (interrupted) {
+			interrupted = false;
+			return 0;
+		}
+
+		Clock::time_point wakeup = deadline;
+		if (pos < records.size() && records[pos].type == READ) {
+			Clock::time_point due = lastEvent + microseconds(records[pos].delay);
+			if (!realtime || readPos > 0 || due <= Clock::now()) {
+				break;
+			}
+			wakeup = std::min(due, deadline);
+		}
+
+		if (Clock::now() >= deadline) {
+			return 0;
+		}
+		event.wait_until(lock, wakeup);
+	}
+
+	const Record &r = records[pos];
+	int len = std::min(max_len, static_cast<int>(r.data.size() - readPos));
+	memcpy(data, r.data.data() + readPos, len);
+	readPos += len;
+
+	if (readPos >= r.data.size()) {
+		consume();
+	}
+
+	return len;
+}
+
+void Replay::interrupt() {
+	LockGuard lock(mutex);
+	interrupted = true;
+	event.notify_all();
+}
+
+static Connection *createReplay() {
+	return new Replay();
+}
+
+extern const ConnectionInfo replayConnectionInfo;
+const ConnectionInfo replayConnectionInfo(createReplay, "replay", "pvlogdev,", "replays a capture file");
+
+} //namespace pvlib {
@@ -0,0 +1,154 @@
+/*
+ *   Pvlib - Capture recording and replay
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "connection.h"
+#include "utility.h"
+
+namespace pvlib {
+
+/*
+ * Capture file format, all integers little endian:
+ *
+ * header: "PVCAP" 0x00, u8 version, u8 reserved
+ * record: u8 type, u32 microseconds since previous record, u16 length, data
+ *
+ * Timestamps are taken from a monotonic clock.
+ */
+namespace capture {
+
+enum RecordType {
+	READ       = 1,
+	WRITE      = 2,
+	CONNECT    = 3, //< data is the address connected to
+	DISCONNECT = 4
+};
+
+} //namespace capture {
+
+/**
+ * Connection decorator recording all data read and written to a capture file.
+ */
+class Recorder : public Connection {
+public:
+	DISABLE_COPY(Recorder)
+
+	/**
+	 * Takes ownership of con.
+	 */
+	Recorder(Connection *con, const std::string &file);
+
+	virtual ~Recorder() override;
+
+	virtual int connect(const char *address, const void *param) override;
+
+	virtual void disconnect() override;
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	/**
+	 * Write segments with the wrapped connection, recorded as one WRITE record.
+	 */
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int max_len, std::string &from) override;
+
+	virtual int readFd() const override { return con->readFd(); }
+
+	virtual void interrupt() override { con->interrupt(); }
+
+private:
+	void record(capture::RecordType type, const uint8_t *data, int len);
+
+	void recordv(capture::RecordType type, const struct iovec *iov, int iovcnt);
+
+	using Clock = std::chrono::steady_clock;
+
+	Connection *con;
+	std::mutex mutex;
+	std::ofstream out;
+	Clock::time_point last;
+};
+
+/**
+ * Connection feeding a capture file back to the protocol.
+ *
+ * Address is the capture file. Data is replayed as fast as possible, unless
+ * realtime is set in pvlib_replay_param, then the original timing is kept.
+ */
+class Replay : public Connection {
+public:
+	DISABLE_COPY(Replay)
+
+	Replay();
+
+	virtual ~Replay() override {}
+
+	virtual int connect(const char *address, const void *param) override;
+
+	virtual void disconnect() override;
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int max_len, std::string &from) override;
+
+	virtual void interrupt() override;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Record {
+		capture::RecordType type;
+		uint32_t delay; //< in microseconds
+		std::vector<uint8_t> data;
+	};
+
+	int load(const std::string &file);
+
+	void consume();
+
+	std::mutex mutex;
+	std::condition_variable event;
+
+	std::string file;
+	std::vector<Record> records;
+	size_t pos;
+	size_t readPos;
+	int unmatchedWrites;
+
+	bool connected;
+	bool interrupted;
+	bool realtime;
+	int timeout;
+	Clock::time_point lastEvent;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef CAPTURE_H */
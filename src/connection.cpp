@@ -23,9 +23,17 @@
 namespace pvlib {
 
 extern ConnectionInfo rfcommConnectionInfo;
+extern ConnectionInfo serialConnectionInfo;
+extern ConnectionInfo simulationConnectionInfo;
+extern ConnectionInfo socketConnectionInfo;
+extern ConnectionInfo replayConnectionInfo;
 
 const std::vector<const ConnectionInfo*> Connection::availableConnections = {
-	&rfcommConnectionInfo
+	&rfcommConnectionInfo,
+	&serialConnectionInfo,
+	&simulationConnectionInfo,
+	&socketConnectionInfo,
+	&replayConnectionInfo
 };
 
 } // namespace pvlib {
@@ -0,0 +1,296 @@
+/*
+ *   Pvlib - PPP frame check sequence
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "fcs"
+
+#include "fcs.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FCS_CLMUL_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && defined(__AARCH64EL__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+//vmull_p64 is only available if the compiler targets the crypto extension
+#define FCS_CLMUL_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace pvlib {
+
+const uint16_t fcstab[256] = { 0x0000, 0x1189, 0x2312, 0x329b, 0x4624,
+		0x57ad, 0x6536, 0x74bf, 0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5,
+		0xe97e, 0xf8f7, 0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7,
+		0x643e, 0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+		0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd, 0xad4a,
+		0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5, 0x3183, 0x200a,
+		0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c, 0xbdcb, 0xac42, 0x9ed9,
+		0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974, 0x4204, 0x538d, 0x6116, 0x709f,
+		0x0420, 0x15a9, 0x2732, 0x36bb, 0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868,
+		0x99e1, 0xab7a, 0xbaf3, 0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528,
+		0x37b3, 0x263a, 0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb,
+		0xaa72, 0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+		0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1, 0x7387,
+		0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738, 0xffcf, 0xee46,
+		0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70, 0x8408, 0x9581, 0xa71a,
+		0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7, 0x0840, 0x19c9, 0x2b52, 0x3adb,
+		0x4e64, 0x5fed, 0x6d76, 0x7cff, 0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad,
+		0xc324, 0xf1bf, 0xe036, 0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c,
+		0x7df7, 0x6c7e, 0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c,
+		0xd1b5, 0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+		0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134, 0x39c3,
+		0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c, 0xc60c, 0xd785,
+		0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3, 0x4a44, 0x5bcd, 0x6956,
+		0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb, 0xd68d, 0xc704, 0xf59f, 0xe416,
+		0x90a9, 0x8120, 0xb3bb, 0xa232, 0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1,
+		0x0d68, 0x3ff3, 0x2e7a, 0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3,
+		0x8238, 0x93b1, 0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70,
+		0x1ff9, 0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+		0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+static uint16_t fcsBytewise(uint16_t fcs, const uint8_t *buf, size_t len)
+{
+	while (len--) {
+		fcs = fcs16(fcs, *buf++);
+	}
+	return fcs;
+}
+
+//table[k][i] is the fcs of byte i followed by k zero bytes
+static const struct SliceTable {
+	uint16_t table[8][256];
+
+	SliceTable() {
+		for (int i = 0; i < 256; ++i) {
+			table[0][i] = fcstab[i];
+		}
+		for (int k = 1; k < 8; ++k) {
+			for (int i = 0; i < 256; ++i) {
+				table[k][i] = fcs16(table[k - 1][i], 0);
+			}
+		}
+	}
+} sliceTable;
+
+static uint16_t fcsSlice8(uint16_t fcs, const uint8_t *buf, size_t len)
+{
+	const uint16_t (*t)[256] = sliceTable.table;
+
+	while (len >= 8) {
+		fcs = t[7][(buf[0] ^ fcs) & 0xff] ^ t[6][(buf[1] ^ (fcs >> 8)) & 0xff] ^
+				t[5][buf[2]] ^ t[4][buf[3]] ^ t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+
+	return fcsBytewise(fcs, buf, len);
+}
+
+#if defined(FCS_CLMUL_X86) || defined(FCS_CLMUL_ARM)
+/*
+ * Fold constant x^n mod P for bit reflected 64 bit lanes, coefficient d is bit 63 - d.
+ *
+ * Bytes are processed in 16 byte blocks X = H * x^64 + L, with H in the
+ * lower lane. Appending a block D gives H * x^192 + L * x^128 + D. The
+ * reflected carry-less product is one bit short, so the constants for H and
+ * L are x^191 and x^127. The folded block is reduced by the slicing kernel.
+ */
+static uint64_t foldConstant(int n)
+{
+	uint32_t r = 1;
+	uint64_t reflected = 0;
+
+	for (int i = 0; i < n; ++i) {
+		r <<= 1;
+		if (r & 0x10000) {
+			r ^= 0x11021;
+		}
+	}
+	for (int d = 0; d < 16; ++d) {
+		if (r & (1u << d)) {
+			reflected |= UINT64_C(1) << (63 - d);
+		}
+	}
+
+	return reflected;
+}
+
+static const uint64_t FOLD_HIGH = foldConstant(191);
+static const uint64_t FOLD_LOW = foldConstant(127);
+#endif
+
+#ifdef FCS_CLMUL_X86
+__attribute__((target("pclmul,sse2")))
+static uint16_t fcsClmul(uint16_t fcs, const uint8_t *buf, size_t len)
+{
+	if (len < 32) {
+		return fcsSlice8(fcs, buf, len);
+	}
+
+	const __m128i k = _mm_set_epi64x(static_cast<int64_t>(FOLD_LOW), static_cast<int64_t>(FOLD_HIGH));
+	//fcs is the same as xoring it into the first two bytes
+	__m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)), _mm_cvtsi32_si128(fcs));
+	buf += 16;
+	len -= 16;
+
+	while (len >= 16) {
+		__m128i high = _mm_clmulepi64_si128(x, k, 0x00);
+		__m128i low = _mm_clmulepi64_si128(x, k, 0x11);
+		x = _mm_xor_si128(_mm_xor_si128(high, low), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)));
+		buf += 16;
+		len -= 16;
+	}
+
+	uint8_t block[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(block), x);
+	fcs = fcsSlice8(0, block, sizeof(block));
+
+	return fcsSlice8(fcs, buf, len);
+}
+
+static bool clmulSupported()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+#endif
+
+#ifdef FCS_CLMUL_ARM
+static uint16_t fcsClmul(uint16_t fcs, const uint8_t *buf, size_t len)
+{
+	if (len < 32) {
+		return fcsSlice8(fcs, buf, len);
+	}
+
+	//fcs is the same as xoring it into the first two bytes
+	uint64x2_t x = veorq_u64(vreinterpretq_u64_u8(vld1q_u8(buf)), vcombine_u64(vcreate_u64(fcs), vcreate_u64(0)));
+	buf += 16;
+	len -= 16;
+
+	while (len >= 16) {
+		poly128_t high = vmull_p64(static_cast<poly64_t>(vgetq_lane_u64(x, 0)), static_cast<poly64_t>(FOLD_HIGH));
+		poly128_t low = vmull_p64(static_cast<poly64_t>(vgetq_lane_u64(x, 1)), static_cast<poly64_t>(FOLD_LOW));
+		x = veorq_u64(veorq_u64(vreinterpretq_u64_p128(high), vreinterpretq_u64_p128(low)),
+				vreinterpretq_u64_u8(vld1q_u8(buf)));
+		buf += 16;
+		len -= 16;
+	}
+
+	uint8_t block[16];
+	vst1q_u8(block, vreinterpretq_u8_u64(x));
+	fcs = fcsSlice8(0, block, sizeof(block));
+
+	return fcsSlice8(fcs, buf, len);
+}
+
+static bool clmulSupported()
+{
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+namespace {
+
+struct Kernel {
+	const char *name;
+	uint16_t (*calc)(uint16_t fcs, const uint8_t *buf, size_t len);
+	bool (*supported)();
+};
+
+bool always() { return true; }
+
+} //namespace {
+
+//fastest first, the byte wise table is the reference
+static const Kernel kernels[] = {
+#if defined(FCS_CLMUL_X86)
+	{ "pclmul", fcsClmul, clmulSupported },
+#elif defined(FCS_CLMUL_ARM)
+	{ "pmull", fcsClmul, clmulSupported },
+#endif
+	{ "slice8", fcsSlice8, always },
+	{ "table", fcsBytewise, always },
+};
+
+//compare kernel against the byte wise table for all alignments and lengths up to some blocks
+static bool selfCheck(const Kernel &kernel)
+{
+	uint8_t buf[16 + 300];
+	uint32_t seed = 0x12345678;
+
+	for (size_t i = 0; i < sizeof(buf); ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = static_cast<uint8_t>(seed >> 16);
+	}
+
+	for (size_t offset = 0; offset < 16; ++offset) {
+		for (size_t len = 0; len + offset <= sizeof(buf); len += (len < 80) ? 1 : 37) {
+			uint16_t init = static_cast<uint16_t>(PPPINITFCS16 ^ (len * 0x9e37));
+			if (kernel.calc(init, buf + offset, len) != fcsBytewise(init, buf + offset, len)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static const Kernel *selectKernel()
+{
+	for (const Kernel &kernel : kernels) {
+		if (!kernel.supported()) {
+			continue;
+		}
+		if (!selfCheck(kernel)) {
+			LOG(Warning) << "FCS kernel " << kernel.name << " differs from table, not using it";
+			continue;
+		}
+
+		LOG(Debug) << "Using FCS kernel " << kernel.name;
+		return &kernel;
+	}
+
+	return &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+}
+
+static const Kernel *activeKernel()
+{
+	static const Kernel *kernel = selectKernel();
+	return kernel;
+}
+
+uint16_t fcs16(uint16_t fcs, const uint8_t *buf, size_t len)
+{
+	return activeKernel()->calc(fcs, buf, len);
+}
+
+const char *fcs16Kernel()
+{
+	return activeKernel()->name;
+}
+
+} //namespace pvlib {
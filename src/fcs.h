@@ -0,0 +1,60 @@
+/*
+ *   Pvlib - PPP frame check sequence
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef FCS_H
+#define FCS_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace pvlib {
+
+static const uint16_t PPPINITFCS16 = 0xffff;
+static const uint16_t PPPGOODFCS16 = 0xf0b8;
+
+/**
+ * Byte wise FCS-16 table of RFC 1662.
+ */
+extern const uint16_t fcstab[256];
+
+/**
+ * Update FCS-16 (RFC 1662) with len bytes of buf.
+ *
+ * Uses the fastest kernel the cpu supports, carry-less multiplication
+ * (PCLMULQDQ or PMULL), slicing-by-8 or the byte wise table. Kernels are
+ * checked against the byte wise table on first use and skipped on mismatch.
+ */
+uint16_t fcs16(uint16_t fcs, const uint8_t *buf, size_t len);
+
+/**
+ * Update FCS-16 of one byte.
+ */
+inline uint16_t fcs16(uint16_t fcs, uint8_t c) {
+	return static_cast<uint16_t>((fcs >> 8) ^ fcstab[(fcs ^ c) & 0xff]);
+}
+
+/**
+ * Name of the kernel used by fcs16.
+ */
+const char *fcs16Kernel();
+
+} //namespace pvlib {
+
+#endif /* #ifndef FCS_H */
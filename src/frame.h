@@ -0,0 +1,171 @@
+/*
+ *   Pvlib - Reference counted frame buffer
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <new>
+#include <utility>
+
+namespace pvlib {
+
+/**
+ * View on a reference counted buffer.
+ *
+ * Copying a frame only takes a reference, so received data can be handed
+ * up the protocol stack and headers stripped without copying. Frames
+ * sharing a buffer may each modify their own region, e.g. to unescape data
+ * in place, but must not touch data outside of it.
+ */
+class Frame {
+public:
+	Frame() : buf(nullptr), offset(0), len(0) {}
+
+	/**
+	 * Allocate new buffer of size bytes.
+	 */
+	static Frame alloc(int size) {
+		void *mem = ::operator new(sizeof(Buffer) + size);
+		Frame frame;
+		frame.buf = new (mem) Buffer();
+		frame.len = size;
+		return frame;
+	}
+
+	/**
+	 * Copy two frames into a new one.
+	 */
+	static Frame concat(const Frame &first, const Frame &second) {
+		Frame frame = alloc(first.len + second.len);
+		if (first.len > 0) memcpy(frame.data(), first.data(), first.len);
+		if (second.len > 0) memcpy(frame.data() + first.len, second.data(), second.len);
+		return frame;
+	}
+
+	Frame(const Frame &other) : buf(other.buf), offset(other.offset), len(other.len) {
+		if (buf != nullptr) {
+			buf->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	Frame(Frame &&other) noexcept : buf(other.buf), offset(other.offset), len(other.len) {
+		other.buf = nullptr;
+		other.offset = 0;
+		other.len = 0;
+	}
+
+	Frame &operator=(const Frame &other) {
+		Frame tmp(other);
+		swap(tmp);
+		return *this;
+	}
+
+	Frame &operator=(Frame &&other) noexcept {
+		Frame tmp(std::move(other));
+		swap(tmp);
+		return *this;
+	}
+
+	~Frame() {
+		if (buf != nullptr && buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			buf->~Buffer();
+			::operator delete(buf);
+		}
+	}
+
+	void swap(Frame &other) noexcept {
+		std::swap(buf, other.buf);
+		std::swap(offset, other.offset);
+		std::swap(len, other.len);
+	}
+
+	uint8_t *data() {
+		return (buf != nullptr) ? buf->data() + offset : nullptr;
+	}
+
+	const uint8_t *data() const {
+		return (buf != nullptr) ? buf->data() + offset : nullptr;
+	}
+
+	int size() const { return len; }
+
+	bool empty() const { return len == 0; }
+
+	/**
+	 * True if no other frame references the buffer.
+	 */
+	bool unique() const {
+		return buf != nullptr && buf->refs.load(std::memory_order_acquire) == 1;
+	}
+
+	/**
+	 * Frame referencing part of this frame.
+	 */
+	Frame slice(int pos, int length) const {
+		assert(pos >= 0 && length >= 0 && pos + length <= len);
+		Frame frame(*this);
+		frame.offset += pos;
+		frame.len = length;
+		return frame;
+	}
+
+	/**
+	 * Remove bytes at the front, e.g. a parsed header.
+	 */
+	void stripFront(int num) {
+		assert(num >= 0 && num <= len);
+		offset += num;
+		len -= num;
+	}
+
+	/**
+	 * Remove bytes at the end.
+	 */
+	void stripBack(int num) {
+		assert(num >= 0 && num <= len);
+		len -= num;
+	}
+
+	void clear() {
+		Frame tmp;
+		swap(tmp);
+	}
+
+private:
+	struct Buffer {
+		std::atomic<int> refs;
+
+		Buffer() : refs(1) {}
+
+		uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1); }
+	};
+
+	Buffer *buf;
+	int offset;
+	int len;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef FRAME_H */
@@ -0,0 +1,451 @@
+/*
+ *   Pvlib - HDLC like framing
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "hdlc"
+
+#include <cstring>
+
+#include "fcs.h"
+#include "hdlc.h"
+#include "log.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HDLC_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__AARCH64EL__)
+#define HDLC_NEON
+#include <arm_neon.h>
+#endif
+
+namespace pvlib {
+
+/*
+ * Scan kernels test a block of bytes at once, escape kernels for the
+ * control characters of ACCM as a range and both for HDLC_ESC and
+ * HDLC_SYNC. The tail shorter than a block is scanned by the scalar loop.
+ */
+
+static size_t findEscapeScalar(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	while (i < len && !hdlcNeedsEscape(data[i])) {
+		++i;
+	}
+	return i;
+}
+
+static size_t findControlScalar(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	while (i < len && data[i] != HDLC_ESC && data[i] != HDLC_SYNC) {
+		++i;
+	}
+	return i;
+}
+
+#ifdef HDLC_SSE2
+static inline __m128i controlMask128(__m128i v)
+{
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(HDLC_ESC)), _mm_cmpeq_epi8(v, _mm_set1_epi8(HDLC_SYNC)));
+}
+
+//bytes 0x11 to 0x13 have v - 0x11 <= 2 unsigned
+static inline __m128i escapeMask128(__m128i v)
+{
+	__m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(0x11));
+	__m128i accm = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(2)), offset);
+	return _mm_or_si128(controlMask128(v), accm);
+}
+
+static size_t findEscapeSse2(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		int mask = _mm_movemask_epi8(escapeMask128(v));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + findEscapeScalar(data + i, len - i);
+}
+
+static size_t findControlSse2(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		int mask = _mm_movemask_epi8(controlMask128(v));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + findControlScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i controlMask256(__m256i v)
+{
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(HDLC_ESC)),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(HDLC_SYNC)));
+}
+
+__attribute__((target("avx2")))
+static size_t findEscapeAvx2(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		__m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(0x11));
+		__m256i accm = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(2)), offset);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(controlMask256(v), accm));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	//no call into sse code, it would pay for the dirty upper ymm halves
+	if (i + 16 <= len) {
+		int mask = _mm_movemask_epi8(escapeMask128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+	return i + findEscapeScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t findControlAvx2(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		uint32_t mask = _mm256_movemask_epi8(controlMask256(v));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	if (i + 16 <= len) {
+		int mask = _mm_movemask_epi8(controlMask128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+	return i + findControlScalar(data + i, len - i);
+}
+
+static bool avx2Supported()
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	//avx2 needs the os to save ymm registers
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+		return false;
+	}
+	uint32_t xcr0;
+	__asm__("xgetbv" : "=a"(xcr0) : "c"(0) : "%edx");
+	if ((xcr0 & 0x6) != 0x6) {
+		return false;
+	}
+	if (__get_cpuid_max(0, nullptr) < 7) {
+		return false;
+	}
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_AVX2) != 0;
+}
+#endif
+
+#ifdef HDLC_NEON
+//index of first set byte of a compare result, 16 if none
+static inline size_t firstSet(uint8x16_t mask)
+{
+	uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+	return (bits == 0) ? 16 : __builtin_ctzll(bits) / 4;
+}
+
+static inline uint8x16_t controlMaskNeon(uint8x16_t v)
+{
+	return vorrq_u8(vceqq_u8(v, vdupq_n_u8(HDLC_ESC)), vceqq_u8(v, vdupq_n_u8(HDLC_SYNC)));
+}
+
+static size_t findEscapeNeon(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(data + i);
+		uint8x16_t accm = vcleq_u8(vsubq_u8(v, vdupq_n_u8(0x11)), vdupq_n_u8(2));
+		size_t pos = firstSet(vorrq_u8(controlMaskNeon(v), accm));
+		if (pos < 16) {
+			return i + pos;
+		}
+	}
+	return i + findEscapeScalar(data + i, len - i);
+}
+
+static size_t findControlNeon(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		size_t pos = firstSet(controlMaskNeon(vld1q_u8(data + i)));
+		if (pos < 16) {
+			return i + pos;
+		}
+	}
+	return i + findControlScalar(data + i, len - i);
+}
+#endif
+
+namespace {
+
+struct Kernel {
+	const char *name;
+	size_t (*findEscape)(const uint8_t *data, size_t len);
+	size_t (*findControl)(const uint8_t *data, size_t len);
+	bool (*supported)();
+};
+
+bool always() { return true; }
+
+} //namespace {
+
+//fastest first, the scalar kernel is the reference
+static const Kernel kernels[] = {
+#if defined(HDLC_SSE2)
+	{ "avx2", findEscapeAvx2, findControlAvx2, avx2Supported },
+	{ "sse2", findEscapeSse2, findControlSse2, always },
+#elif defined(HDLC_NEON)
+	{ "neon", findEscapeNeon, findControlNeon, always },
+#endif
+	{ "scalar", findEscapeScalar, findControlScalar, always },
+};
+
+//every byte value at every position of some blocks
+static bool selfCheck(const Kernel &kernel)
+{
+	uint8_t buf[96];
+
+	for (int c = 0; c < 256; ++c) {
+		for (size_t pos = 0; pos < sizeof(buf); pos += 7) {
+			memset(buf, 0x55, sizeof(buf));
+			buf[pos] = static_cast<uint8_t>(c);
+			for (size_t len = pos; len <= sizeof(buf); len += 13) {
+				if (kernel.findEscape(buf, len) != findEscapeScalar(buf, len) ||
+						kernel.findControl(buf, len) != findControlScalar(buf, len)) {
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static const Kernel *selectKernel()
+{
+	for (const Kernel &kernel : kernels) {
+		if (!kernel.supported()) {
+			continue;
+		}
+		if (!selfCheck(kernel)) {
+			LOG(Warning) << "HDLC kernel " << kernel.name << " differs from scalar code, not using it";
+			continue;
+		}
+
+		LOG(Debug) << "Using HDLC kernel " << kernel.name;
+		return &kernel;
+	}
+
+	return &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+}
+
+static const Kernel *activeKernel()
+{
+	static const Kernel *kernel = selectKernel();
+	return kernel;
+}
+
+size_t hdlcFindEscape(const uint8_t *data, size_t len)
+{
+	return activeKernel()->findEscape(data, len);
+}
+
+size_t hdlcFindControl(const uint8_t *data, size_t len)
+{
+	return activeKernel()->findControl(data, len);
+}
+
+const char *hdlcKernel()
+{
+	return activeKernel()->name;
+}
+
+std::vector<HdlcKernel> hdlcKernels()
+{
+	std::vector<HdlcKernel> supported;
+	for (const Kernel &kernel : kernels) {
+		if (kernel.supported()) {
+			supported.push_back(HdlcKernel{ kernel.name, kernel.findEscape, kernel.findControl });
+		}
+	}
+	return supported;
+}
+
+HdlcDeframer::HdlcDeframer(int maxSize) :
+		maxSize(maxSize),
+		inFrame(false),
+		inPlace(false),
+		escaped(false),
+		tooBig(false),
+		outLen(0),
+		fcs(PPPINITFCS16) {
+
+}
+
+void HdlcDeframer::reset()
+{
+	inFrame = false;
+	escaped = false;
+	out.clear();
+}
+
+//append unescaped run, in place it is only moved after an escape
+void HdlcDeframer::emit(const uint8_t *data, int len)
+{
+	fcs = fcs16(fcs, data, len);
+	if (outLen + len > maxSize) {
+		tooBig = true;
+		return;
+	}
+
+	uint8_t *dst = out.data() + outLen;
+	if (dst != data) {
+		memmove(dst, data, len);
+	}
+	outLen += len;
+}
+
+void HdlcDeframer::emit(uint8_t c)
+{
+	fcs = fcs16(fcs, c);
+	if (outLen >= maxSize) {
+		tooBig = true;
+		return;
+	}
+	out.data()[outLen++] = c;
+}
+
+int HdlcDeframer::finish(Frame &frame)
+{
+	inFrame = false;
+	Frame data = std::move(out);
+	out.clear();
+
+	if (tooBig) {
+		LOG(Error) << "Failed: frame to big!";
+		return -1;
+	}
+	if (fcs != PPPGOODFCS16 || outLen < 2) {
+		LOG(Error) << "Invalid frame!";
+		return -1;
+	}
+
+	frame = data.slice(0, outLen - 2);
+	return 1;
+}
+
+int HdlcDeframer::next(Frame &chunk, Frame &frame)
+{
+	if (!inFrame) {
+		//remove all HDLC_SYNC bytes, because emtpy frames are allowed.
+		int start = 0;
+		while (start < chunk.size() && chunk.data()[start] == HDLC_SYNC) {
+			start++;
+		}
+		chunk.stripFront(start);
+		if (chunk.empty()) {
+			return 0;
+		}
+
+		inFrame = true;
+		inPlace = true;
+		escaped = false;
+		tooBig = false;
+		out = chunk;
+		outLen = 0;
+		fcs = PPPINITFCS16;
+	}
+
+	const uint8_t *data = chunk.data();
+	int len = chunk.size();
+	int pos = 0;
+
+	if (escaped && len > 0) {
+		escaped = false;
+		if (data[0] == HDLC_SYNC) {
+			emit(HDLC_ESC); //escape without byte is kept
+		} else {
+			emit(static_cast<uint8_t>(data[0] ^ 0x20));
+			pos = 1;
+		}
+	}
+
+	while (pos < len) {
+		int run = hdlcFindControl(data + pos, len - pos);
+		if (run > 0) {
+			emit(data + pos, run);
+			pos += run;
+		}
+		if (pos >= len) {
+			break;
+		}
+
+		if (data[pos] == HDLC_SYNC) {
+			chunk.stripFront(pos + 1);
+			return finish(frame);
+		}
+
+		if (pos + 1 >= len) {
+			escaped = true; //escaped byte is in next chunk
+			pos++;
+		} else if (data[pos + 1] == HDLC_SYNC) {
+			emit(HDLC_ESC);
+			pos++;
+		} else {
+			emit(static_cast<uint8_t>(data[pos + 1] ^ 0x20));
+			pos += 2;
+		}
+	}
+
+	//frame continues in next chunk, which is another buffer
+	if (inPlace) {
+		Frame copy = Frame::alloc(maxSize);
+		memcpy(copy.data(), out.data(), outLen);
+		out = std::move(copy);
+		inPlace = false;
+	}
+	chunk.clear();
+
+	return 0;
+}
+
+} //namespace pvlib {
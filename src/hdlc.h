@@ -0,0 +1,120 @@
+/*
+ *   Pvlib - HDLC like framing
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef HDLC_H
+#define HDLC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "frame.h"
+#include "utility.h"
+
+namespace pvlib {
+
+static const uint32_t ACCM = 0x000E0000; //< escaped control characters 0x11 to 0x13
+static const uint8_t HDLC_ESC  = 0x7d;
+static const uint8_t HDLC_SYNC = 0x7e;
+
+inline bool hdlcNeedsEscape(uint8_t c) {
+	return ((c < 0x20) && (ACCM & (0x00000001 << c))) || (c == HDLC_ESC) || (c == HDLC_SYNC);
+}
+
+/**
+ * Find first byte needing escaping.
+ *
+ * @return index of the byte, len if there is none.
+ */
+size_t hdlcFindEscape(const uint8_t *data, size_t len);
+
+/**
+ * Find first HDLC_ESC or HDLC_SYNC.
+ *
+ * @return index of the byte, len if there is none.
+ */
+size_t hdlcFindControl(const uint8_t *data, size_t len);
+
+/**
+ * Name of the scan kernel, SIMD kernels are checked against the
+ * scalar one on first use and skipped on mismatch.
+ */
+const char *hdlcKernel();
+
+struct HdlcKernel {
+	const char *name;
+	size_t (*findEscape)(const uint8_t *data, size_t len);
+	size_t (*findControl)(const uint8_t *data, size_t len);
+};
+
+/**
+ * All scan kernels the cpu supports, fastest first, the last one is scalar.
+ * Used to benchmark the kernels against each other.
+ */
+std::vector<HdlcKernel> hdlcKernels();
+
+/**
+ * Resumable deframer for received chunks of any size.
+ *
+ * Frames are unescaped in place while their FCS is computed in the same
+ * pass, only frames spanning chunks are copied into an own buffer.
+ */
+class HdlcDeframer {
+public:
+	DISABLE_COPY(HdlcDeframer)
+
+	/**
+	 * @param maxSize maximal unescaped frame size including FCS.
+	 */
+	explicit HdlcDeframer(int maxSize);
+
+	/**
+	 * Parse chunk up to the end of the next frame, parsed bytes are removed from chunk.
+	 *
+	 * @param[out] frame unescaped frame without FCS, references the chunk's buffer.
+	 * @return 1 if a frame is complete, 0 if chunk is consumed, < 0 if a frame was dropped.
+	 */
+	int next(Frame &chunk, Frame &frame);
+
+	/**
+	 * Drop frame in progress.
+	 */
+	void reset();
+
+private:
+	void emit(const uint8_t *data, int len);
+
+	void emit(uint8_t c);
+
+	int finish(Frame &frame);
+
+	int maxSize;
+	bool inFrame;
+	bool inPlace; //< out is a view on the chunk
+	bool escaped; //< chunk ended with HDLC_ESC
+	bool tooBig;
+	Frame out;
+	int outLen;
+	uint16_t fcs;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef HDLC_H */
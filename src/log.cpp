@@ -83,4 +83,26 @@ std::ostream& operator<<(std::ostream& o, const print_array& a) {
 	return o;
 }
 
+std::ostream& operator<<(std::ostream& o, const print_iovec& v) {
+	size_t pos = 0;
+	size_t size = 0;
+
+	for (int i = 0; i < v.iovcnt; ++i) {
+		size += v.iov[i].iov_len;
+	}
+
+	o <<  std::hex << std::setfill('0');
+	for (int i = 0; i < v.iovcnt; ++i) {
+		const uint8_t *data = static_cast<const uint8_t*>(v.iov[i].iov_base);
+		for (size_t j = 0; j < v.iov[i].iov_len; ++j, ++pos) {
+			o << std::setw(2) << (int)data[j] << " ";
+			if (((pos + 1) % 16 == 0) || (pos + 1 == size)) {
+				o << "\n";
+			}
+		}
+	}
+
+	return o;
+}
+
 } //namespace pvlib {
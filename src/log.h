@@ -24,6 +24,7 @@
 #include <sstream>
 #include <string>
 #include <unordered_set>
+#include <sys/uio.h>
 
 #include "utility.h"
 #include "pvlib.h"
@@ -85,6 +86,15 @@ struct print_array {
 
 std::ostream& operator<<(std::ostream& o, const print_array& a);
 
+struct print_iovec {
+	const struct iovec *iov;
+	int iovcnt;
+
+	print_iovec(const struct iovec *iov, int iovcnt) : iov(iov), iovcnt(iovcnt) {}
+};
+
+std::ostream& operator<<(std::ostream& o, const print_iovec& v);
+
 #ifndef PVLIB_LOG_MODULE
 #	define PVLIB_LOG_MODULE "global"
 #endif
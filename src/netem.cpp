@@ -0,0 +1,371 @@
+/*
+ *   Pvlib - Network condition emulator
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "netem"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "netem.h"
+
+namespace pvlib {
+
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+using Milliseconds = std::chrono::duration<double, std::milli>;
+
+int Netem::parse(const char *spec, Config *config) {
+	std::string str(spec);
+	size_t pos = 0;
+
+	*config = Config();
+	while (pos < str.size()) {
+		size_t end = str.find(',', pos);
+		if (end == std::string::npos) {
+			end = str.size();
+		}
+		std::string item = str.substr(pos, end - pos);
+		pos = end + 1;
+
+		if (item.empty()) {
+			continue;
+		}
+
+		size_t sep = item.find('=');
+		if (sep == std::string::npos) {
+			LOG(Error) << "Invalid option, expected key=value: " << item;
+			return -1;
+		}
+
+		std::string key = item.substr(0, sep);
+		const char *value = item.c_str() + sep + 1;
+		char *valueEnd;
+		double val = strtod(value, &valueEnd);
+		if (valueEnd == value || *valueEnd != '\0' || val < 0) {
+			LOG(Error) << "Invalid value: " << item;
+			return -1;
+		}
+
+		if (key == "latency") {
+			config->latency = val;
+		} else if (key == "jitter") {
+			config->jitter = val;
+		} else if (key == "rate") {
+			config->rate = static_cast<uint32_t>(val);
+		} else if (key == "corrupt" && val <= 1) {
+			config->corrupt = val;
+		} else if (key == "loss" && val <= 1) {
+			config->loss = val;
+		} else if (key == "seed") {
+			config->seed = static_cast<uint32_t>(val);
+		} else {
+			LOG(Error) << "Invalid option: " << item;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+Netem *Netem::fromEnv(const char *name, ReadWrite *next, int timeout) {
+	const char *spec = getenv(name);
+	Config config;
+
+	if (spec == nullptr || spec[0] == '\0') {
+		return nullptr;
+	}
+
+	if (parse(spec, &config) < 0) {
+		LOG(Error) << "Ignoring invalid " << name << ": " << spec;
+		return nullptr;
+	}
+
+	LOG(Info) << "Emulating network conditions (" << name << "): " << spec;
+	return new Netem(next, config, timeout);
+}
+
+Netem::Netem(ReadWrite *next, const Config &config, int timeout) :
+		next(next),
+		config(config),
+		timeout(timeout),
+		running(false),
+		interrupted(false),
+		error(0),
+		random(config.seed),
+		tx{},
+		rx{},
+		readPos(0),
+		framesSent(0),
+		framesReceived(0),
+		framesLost(0),
+		bytesCorrupted(0) {
+	quit.store(false);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+Netem::~Netem() {
+	stop();
+
+	if (wakeFd >= 0) {
+		close(wakeFd);
+	}
+
+	LOG(Info) << "sent " << framesSent << " frames, received " << framesReceived
+			<< " frames, lost " << framesLost << " frames, corrupted " << bytesCorrupted << " bytes";
+}
+
+bool Netem::lose() {
+	if (config.loss <= 0) {
+		return false;
+	}
+
+	if (std::uniform_real_distribution<double>(0, 1)(random) < config.loss) {
+		++framesLost;
+		return true;
+	}
+	return false;
+}
+
+void Netem::corrupt(uint8_t *data, int len) {
+	if (config.corrupt <= 0) {
+		return;
+	}
+
+	std::uniform_real_distribution<double> dist(0, 1);
+	for (int i = 0; i < len; ++i) {
+		if (dist(random) < config.corrupt) {
+			data[i] ^= 1 << (random() % 8);
+			++bytesCorrupted;
+		}
+	}
+}
+
+Netem::Clock::time_point Netem::schedule(Direction &dir, int len) {
+	double delay = config.latency;
+	if (config.jitter > 0) {
+		delay += std::uniform_real_distribution<double>(-config.jitter, config.jitter)(random);
+	}
+	delay = std::max(0.0, delay);
+
+	//frames queue up behind each other on a rate limited link
+	dir.busy = std::max(Clock::now(), dir.busy);
+	if (config.rate > 0) {
+		double sendTime = 1000.0 * len * 8 / config.rate;
+		dir.busy += std::chrono::duration_cast<Clock::duration>(Milliseconds(sendTime));
+	}
+
+	Clock::time_point arrival = dir.busy + std::chrono::duration_cast<Clock::duration>(Milliseconds(delay));
+	dir.arrival = std::max(arrival, dir.arrival);
+
+	return dir.arrival;
+}
+
+int Netem::write(const uint8_t *data, int len, const std::string &to) {
+	std::vector<uint8_t> buf(data, data + len);
+	Clock::time_point due;
+
+	{
+		LockGuard lock(mutex);
+		++framesSent;
+		if (lose()) {
+			LOG(Debug) << "Lost written frame";
+			return len;
+		}
+		corrupt(buf.data(), len);
+		due = schedule(tx, len);
+	}
+
+	std::this_thread::sleep_until(due);
+	return next->write(buf.data(), len, to);
+}
+
+//block on fd of next if it has one, returns 0 if nothing to read
+int Netem::waitNext() {
+	int fd = next->readFd();
+	if (fd < 0) {
+		return 1; //read of next waits itself
+	}
+
+	struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+	int ret = poll(pfd, (wakeFd >= 0) ? 2 : 1, -1);
+	if (ret < 0 && errno != EINTR) {
+		return -1;
+	}
+	return (ret > 0 && (pfd[0].revents != 0)) ? 1 : 0;
+}
+
+void Netem::pump() {
+	while (!quit.load()) {
+		Frame frame;
+		std::string from;
+		int ret = waitNext();
+		if (ret > 0) {
+			ret = next->readFrame(frame, from);
+		}
+
+		LockGuard lock(mutex);
+		if (ret < 0) {
+			error = ret;
+			event.notify_all();
+			return;
+		} else if (ret == 0) {
+			continue;
+		}
+
+		++framesReceived;
+		if (lose()) {
+			LOG(Debug) << "Lost received frame";
+			continue;
+		}
+
+		corrupt(frame.data(), frame.size());
+		frames.push_back(Pending{schedule(rx, frame.size()), std::move(from), std::move(frame)});
+		event.notify_all();
+	}
+}
+
+//wait until a frame is due, returns < 0 on error, 0 on timeout
+int Netem::wait(UniqueLock &lock) {
+	if (!running) {
+		if (thread.joinable()) {
+			lock.unlock();
+			thread.join();
+			lock.lock();
+		}
+		quit.store(false);
+		error = 0;
+		running = true;
+		thread = std::thread([this] { pump(); });
+	}
+
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout);
+	for (;;) {
+		Clock::time_point now = Clock::now();
+		Clock::time_point wakeup = deadline;
+
+		if (!frames.empty()) {
+			if (frames.front().due <= now) {
+				return 1;
+			}
+			wakeup = std::min(frames.front().due, deadline);
+		} else if (error < 0) {
+			running = false;
+			return error;
+		}
+
+		if (now >= deadline || interrupted) {
+			interrupted = false;
+			return 0;
+		}
+		event.wait_until(lock, wakeup);
+	}
+}
+
+int Netem::read(uint8_t *data, int maxlen, std::string &from) {
+	UniqueLock lock(mutex);
+	int ret;
+
+	if ((ret = wait(lock)) <= 0) {
+		return ret;
+	}
+
+	Frame &frame = frames.front().data;
+	int len = std::min(maxlen, frame.size() - static_cast<int>(readPos));
+	memcpy(data, frame.data() + readPos, len);
+	from = frames.front().from;
+
+	readPos += len;
+	if (readPos >= static_cast<size_t>(frame.size())) {
+		frames.pop_front();
+		readPos = 0;
+	}
+
+	return len;
+}
+
+int Netem::readFrame(Frame &frame, std::string &from) {
+	UniqueLock lock(mutex);
+	int ret;
+
+	if ((ret = wait(lock)) <= 0) {
+		return ret;
+	}
+
+	frame = std::move(frames.front().data);
+	frame.stripFront(readPos);
+	from = std::move(frames.front().from);
+	frames.pop_front();
+	readPos = 0;
+
+	return frame.size();
+}
+
+void Netem::setReadTimeout(int timeout) {
+	{
+		LockGuard lock(mutex);
+		this->timeout = timeout;
+	}
+	next->setReadTimeout(timeout);
+}
+
+void Netem::interrupt() {
+	LockGuard lock(mutex);
+	interrupted = true;
+	event.notify_all();
+}
+
+void Netem::stop() {
+	uint64_t count = 1;
+
+	quit.store(true);
+	if (thread.joinable()) {
+		//pump is blocked in next or on its fd
+		next->interrupt();
+		if (wakeFd >= 0 && ::write(wakeFd, &count, sizeof(count)) < 0) {
+			LOG(Warning) << "Failed waking up pump: " << strerror(errno);
+		}
+		thread.join();
+		if (wakeFd >= 0 && ::read(wakeFd, &count, sizeof(count)) < 0) {
+			//nothing to reset
+		}
+	}
+
+	LockGuard lock(mutex);
+	running = false;
+}
+
+void Netem::reset() {
+	stop();
+
+	LockGuard lock(mutex);
+	frames.clear();
+	readPos = 0;
+	error = 0;
+	tx = Direction{};
+	rx = Direction{};
+}
+
+} //namespace pvlib {
@@ -0,0 +1,157 @@
+/*
+ *   Pvlib - Network condition emulator
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef NETEM_H
+#define NETEM_H
+
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "readWrite.h"
+#include "utility.h"
+
+namespace pvlib {
+
+/**
+ * ReadWrite decorator emulating a bad link.
+ *
+ * Every write and every chunk read from the next stage is a frame, which can
+ * be lost, get bits flipped and is delayed by latency, jitter and the
+ * serialization time of the configured rate. Frames keep their order.
+ *
+ * Configuration is a comma separated key=value list:
+ * latency=<ms>,jitter=<ms>,rate=<bit/s>,corrupt=<per byte>,loss=<per frame>,seed=<n>
+ * All keys are optional, the same seed reproduces the same pattern.
+ */
+class Netem : public ReadWrite {
+public:
+	DISABLE_COPY(Netem)
+
+	struct Config {
+		double   latency; //< one way delay in ms
+		double   jitter;  //< maximal deviation of the delay in ms
+		uint32_t rate;    //< in bit/s, 0 is unlimited
+		double   corrupt; //< probability of a bit error per byte
+		double   loss;    //< probability of a frame getting lost
+		uint32_t seed;
+
+		Config() : latency(0), jitter(0), rate(0), corrupt(0), loss(0), seed(1) {}
+	};
+
+	/**
+	 * Parse configuration string.
+	 *
+	 * @return < 0 if string is invalid.
+	 */
+	static int parse(const char *spec, Config *config);
+
+	/**
+	 * Create emulator configured by environment variable name.
+	 *
+	 * @return emulator or nullptr if variable is not set or invalid.
+	 */
+	static Netem *fromEnv(const char *name, ReadWrite *next, int timeout);
+
+	/**
+	 * @param next stage data is passed to.
+	 * @param timeout read timeout in ms, should match the one of next.
+	 */
+	Netem(ReadWrite *next, const Config &config, int timeout);
+
+	virtual ~Netem();
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int maxlen, std::string &from) override;
+
+	virtual int readFrame(Frame &frame, std::string &from) override;
+
+	virtual void setReadTimeout(int timeout) override;
+
+	virtual void interrupt() override;
+
+	/**
+	 * Stop reading from next stage and drop frames in flight.
+	 */
+	void reset();
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Direction {
+		Clock::time_point busy;    //< link busy until
+		Clock::time_point arrival; //< arrival of last frame
+	};
+
+	struct Pending {
+		Clock::time_point due;
+		std::string from;
+		Frame data;
+	};
+
+	bool lose();
+
+	void corrupt(uint8_t *data, int len);
+
+	Clock::time_point schedule(Direction &dir, int len);
+
+	int wait(std::unique_lock<std::mutex> &lock);
+
+	int waitNext();
+
+	void stop();
+
+	void pump();
+
+	ReadWrite *next;
+	Config config;
+	int timeout;
+
+	std::mutex mutex;
+	std::condition_variable event;
+	std::thread thread;
+	std::atomic_bool quit;
+	bool running;
+	bool interrupted;
+	int error;
+	int wakeFd; //< stops pump blocking on the fd of next
+
+	std::mt19937 random;
+	Direction tx;
+	Direction rx;
+	std::deque<Pending> frames;
+	size_t readPos;
+
+	uint64_t framesSent;
+	uint64_t framesReceived;
+	uint64_t framesLost;
+	uint64_t bytesCorrupted;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef NETEM_H */
@@ -58,6 +58,11 @@ public:
 
 	virtual int readEvents(uint32_t id, time_t from, time_t to, pvlib_event **events) = 0;
 
+	//optional
+	virtual int readLinkStats(pvlib_link_stats *stats) { return -1; }
+
+	virtual int readBluetoothNodes(pvlib_bluetooth_node *nodes, int maxNodes, int maxAge) { return -1; }
+
 	static const std::vector<const ProtocolInfo*> availableProtocols;
 };
 
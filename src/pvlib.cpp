@@ -21,7 +21,10 @@
 
 #include <stdlib.h>
 #include <malloc.h>
+#include <atomic>
+#include <string>
 
+#include "capture.h"
 #include "connection.h"
 #include "protocol.h"
 #include "pvlib.h"
@@ -141,6 +144,17 @@ pvlib_plant *pvlib_open(uint32_t connection,
 		return NULL;
 	}
 
+	const char *capture = getenv("PVLIB_CAPTURE_FILE");
+	if (capture != NULL && capture[0] != '\0') {
+		static std::atomic<int> captures(0);
+		std::string file(capture);
+		int num = captures++;
+		if (num > 0) {
+			file += "." + std::to_string(num);
+		}
+		con = new Recorder(con, file);
+	}
+
 	prot = Protocol::availableProtocols[protocol]->create(con);
 	if (prot == NULL) {
 		return NULL;
@@ -224,6 +238,14 @@ int pvlib_get_events(pvlib_plant *plant, uint32_t id, time_t from, time_t to, pv
 	return plant->protocol->readEvents(id, from, to, events);
 }
 
+int pvlib_get_link_stats(pvlib_plant *plant, pvlib_link_stats *stats) {
+	return plant->protocol->readLinkStats(stats);
+}
+
+int pvlib_get_bluetooth_nodes(pvlib_plant *plant, pvlib_bluetooth_node *nodes, int max_nodes, int max_age) {
+	return plant->protocol->readBluetoothNodes(nodes, max_nodes, max_age);
+}
+
 void *pvlib_protocol_handle(pvlib_plant *plant) {
 	return plant->protocol;
 }
@@ -49,10 +49,101 @@ typedef enum pvlib_connection {
 	PVLIB_RFCOMM
 } pvlib_connection;
 
+typedef enum pvlib_rfcomm_remote_name {
+	PVLIB_RFCOMM_REMOTE_NAME_BACKGROUND, ///< looked up after connecting (default)
+	PVLIB_RFCOMM_REMOTE_NAME_BLOCKING,   ///< looked up before connecting
+	PVLIB_RFCOMM_REMOTE_NAME_SKIP        ///< not looked up
+} pvlib_rfcomm_remote_name;
+
+/**
+ * Parameters of the rfcomm connection, passed as connection_param.
+ * If NULL the defaults are used.
+ *
+ * Local and remote identity are cached, a reconnect goes straight
+ * to the rfcomm socket. Plants on different adapters can be used from
+ * different threads concurrently.
+ */
+typedef struct pvlib_rfcomm_param {
+	int remote_name;     ///< @see pvlib_rfcomm_remote_name
+	const char *adapter; ///< local adapter as index "1", "hci1" or mac, NULL for the default
+} pvlib_rfcomm_param;
+
+/**
+ * Parameters of the serial connection, passed as connection_param.
+ * If NULL the defaults are used.
+ *
+ * vmin and vtime are the termios settings, a read returns after vmin bytes
+ * or when no byte arrived for vtime. Larger values mean fewer reads per frame.
+ */
+typedef struct pvlib_serial_param {
+	int baudrate; ///< e.g. 1200 for SMA RS485, 0 keeps the device setting
+	int vmin;     ///< bytes to batch per read, 0 returns what is available (max 255)
+	int vtime;    ///< inter byte timeout in 1/10 s, needed if vmin is set
+} pvlib_serial_param;
+
+/**
+ * Parameters of the socket connection, passed as connection_param.
+ * If NULL the defaults are used.
+ */
+typedef struct pvlib_socket_param {
+	int rcvbuf;  ///< SO_RCVBUF size in bytes, 0 keeps the system default
+	int nodelay; ///< if not 0 TCP_NODELAY is set on tcp connections (default)
+} pvlib_socket_param;
+
+/**
+ * Parameters of the replay connection, passed as connection_param.
+ * If NULL the capture is replayed as fast as possible.
+ */
+typedef struct pvlib_replay_param {
+	int realtime; ///< if not 0 the recorded timing is kept
+} pvlib_replay_param;
+
 typedef enum pvlib_protocol {
 	PVLIB_SMADATA2PLUS, PVLIB_SMADATA
 } pvlib_protocol;
 
+/**
+ * Parameters of the smadata2plus protocol, passed as protocol_param.
+ * If NULL or a field is 0 the default is used.
+ *
+ * Read deadlines adapt per device to the measured round trip time,
+ * until the first reply of a device timeout is used.
+ */
+typedef struct pvlib_smadata2plus_param {
+	int timeout;     ///< initial read deadline in ms (5000)
+	int min_timeout; ///< lower bound of adaptive read deadlines in ms (100)
+	int max_timeout; ///< upper bound of adaptive read deadlines in ms (10000)
+	int fixed;       ///< if not 0 always timeout is used
+	int queue_size;  ///< received packets buffered until read (64)
+	int backpressure; ///< if not 0 stop reading the link while the queue is full instead of dropping
+	int inline_io;   ///< if not 0 no receive thread is used, the calling thread reads itself
+	int keepalive;   ///< seconds of idle link after which a signal query keeps it open, 0 disables (0), needs the receive thread
+} pvlib_smadata2plus_param;
+
+/**
+ * Statistics of the link between plant and reader.
+ */
+typedef struct pvlib_link_stats {
+	uint32_t queue_size;     ///< capacity of the receive queue in packets
+	uint32_t high_watermark; ///< maximal number of packets queued at once
+	uint64_t dropped;        ///< packets dropped because the queue was full
+	uint64_t stalled;        ///< times reading stopped because the queue was full (backpressure)
+	uint64_t wakeups;        ///< times the receiver woke up, only grows with traffic if the connection has an fd
+	uint64_t keepalives;         ///< keepalive queries sent
+	uint64_t keepalives_missed;  ///< keepalive queries not answered until the next one was due
+	uint64_t reconnects_avoided; ///< requests sent over a link that was kept alive while idle
+} pvlib_link_stats;
+
+/**
+ * Device of the bluetooth network.
+ */
+typedef struct pvlib_bluetooth_node {
+	uint8_t mac[6];  ///< in transmission order, reversed to the usual notation
+	uint8_t type[2]; ///< node flags as reported in the device list
+	int signal;      ///< signal strength from 0 to 100, < 0 if unknown
+	int age;         ///< seconds since the signal strength was measured
+} pvlib_bluetooth_node;
+
 typedef struct pvlib_ac {
 	time_t time;
 	int32_t totalPower; ///< current power of string inverter in watts
@@ -270,6 +361,10 @@ const char *pvlib_protocol_name(uint32_t protocol);
  * @param connection connection type
  * @param protocol protocol type
  *
+ * If the environment variable PVLIB_CAPTURE_FILE is set all data of the
+ * connection is recorded to that file, it can be fed back with the replay
+ * connection. Further plants opened append .1, .2, ... to the file name.
+ *
  * @return on error(invalid connection or protocol handle) NULL.
  */
 pvlib_plant *pvlib_open(uint32_t connection,
@@ -280,10 +375,15 @@ pvlib_plant *pvlib_open(uint32_t connection,
 /**
  * Connect to plant/string_inverter
  *
- * @param con_address connection specific for rfcomm bluetoooth mac of target.
- * @param con_param connection specific.
+ * @param con_address connection specific for rfcomm bluetoooth mac of target,
+ *        for serial the tty device, for socket host:port of a tcp gateway or path of a unix socket,
+ *        for replay the capture file.
+ * @param con_param connection specific, for rfcomm pvlib_rfcomm_param,
+ *        for serial pvlib_serial_param,
+ *        for socket pvlib_socket_param,
+ *        for replay pvlib_replay_param or NULL.
  * @param protocol_passwd password for plant.
- * @param protocol_param protocol specific.
+ * @param protocol_param protocol specific, for smadata2plus pvlib_smadata2plus_param or NULL.
  *
  */
 int pvlib_connect(pvlib_plant *plant,
@@ -398,6 +498,29 @@ int pvlib_get_day_yield(pvlib_plant *plant, uint32_t id, time_t from, time_t to,
  */
 int pvlib_get_events(pvlib_plant *plant, uint32_t id, time_t from, time_t to, pvlib_event **events);
 
+/**
+ * Get statistics of the link, counters are kept across reconnects.
+ *
+ * @param plant plant handle
+ * @param[out] stats link statistics
+ * @return < 0 if not supported by protocol.
+ */
+int pvlib_get_link_stats(pvlib_plant *plant, pvlib_link_stats *stats);
+
+/**
+ * Get all devices of the bluetooth network with their signal strength.
+ *
+ * Signal strengths older than max_age seconds are queried again, all nodes
+ * at once, so the call blocks at most for one query timeout.
+ *
+ * @param plant plant handle
+ * @param[out] nodes bluetooth nodes
+ * @param max_nodes size of nodes
+ * @param max_age in seconds, < 0 returns cached values only.
+ * @return number of nodes, may be larger than max_nodes, < 0 if not supported by protocol.
+ */
+int pvlib_get_bluetooth_nodes(pvlib_plant *plant, pvlib_bluetooth_node *nodes, int max_nodes, int max_age);
+
 /**
  * Returns protocol handle.
  * This must not be supported by protocol, so NULL does not mean an error occurred.
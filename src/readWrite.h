@@ -22,11 +22,17 @@
 #define SRC_PVLIB_SRC_READWRITE_H_
 
 #include <string>
+#include <vector>
+#include <sys/uio.h>
+
+#include "frame.h"
 
 namespace pvlib {
 
 class ReadWrite {
 public:
+	static constexpr int FRAME_CHUNK_SIZE = 512;
+
 	virtual ~ReadWrite() {}
 
 	/**
@@ -44,6 +50,22 @@ public:
 		return write(data, len, "");
 	}
 
+	/**
+	 * Write data gathered from several segments.
+	 * Stages prepending headers override it to pass segments on instead of
+	 * copying, the default copies all segments and calls write.
+	 *
+	 * @return < 0 if error occurs.
+	 */
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) {
+		std::vector<uint8_t> buf;
+		for (int i = 0; i < iovcnt; ++i) {
+			const uint8_t *data = static_cast<const uint8_t*>(iov[i].iov_base);
+			buf.insert(buf.end(), data, data + iov[i].iov_len);
+		}
+		return write(buf.data(), buf.size(), to);
+	}
+
 	/**
 	 * Read data.
 	 *
@@ -60,6 +82,48 @@ public:
 		std::string str;
 		return read(data, max_len, str);
 	}
+
+	/**
+	 * Read data without copying.
+	 * Stages passing received buffers on override it, the default reads
+	 * into a newly allocated frame.
+	 *
+	 * @param[out] frame data read.
+	 *
+	 * @return < 0 if error occurs, else amount of bytes read.
+	 */
+	virtual int readFrame(Frame &frame, std::string &from) {
+		Frame buf = Frame::alloc(FRAME_CHUNK_SIZE);
+		int ret = read(buf.data(), buf.size(), from);
+		if (ret > 0) {
+			buf.stripBack(buf.size() - ret);
+			frame = std::move(buf);
+		}
+		return ret;
+	}
+
+	/**
+	 * Set how long read waits for data before returning 0.
+	 * Stages without own deadline ignore it.
+	 *
+	 * @param timeout timeout in ms
+	 */
+	virtual void setReadTimeout(int timeout) {}
+
+	/**
+	 * File descriptor becoming readable when read has data, so readers can
+	 * block on it together with other fds instead of polling read.
+	 *
+	 * @return fd or < 0 if not available.
+	 */
+	virtual int readFd() const { return -1; }
+
+	/**
+	 * Make a read blocked in another thread return 0 now instead of after
+	 * its timeout, used to stop reader threads. Stages having a readFd may
+	 * ignore it, their readers block on the fd with an own wakeup fd.
+	 */
+	virtual void interrupt() {}
 };
 
 } //namespace pvlib {
@@ -23,6 +23,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <thread>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -51,103 +52,234 @@
 
 #include "connection.h"
 #include "log.h"
+#include "pvlib.h"
 #include "rfcomm.h"
 
 namespace pvlib {
 
+using LockGuard = std::lock_guard<std::mutex>;
+
 const static int TIMEOUT = 5; /* in seconds */
 
 Rfcomm::Rfcomm() :
 		connected(false),
 		timeout(TIMEOUT),
-		socket(0) {
-
+		socket(-1),
+		devId(-1),
+		localCached(false),
+		remote(std::make_shared<RemoteName>()) {
+	src_name[0] = '\0';
+	memset(src_mac, 0, sizeof(src_mac));
+	memset(remote->mac, 0, sizeof(remote->mac));
+	remote->name[0] = '\0';
+	remote->cached = false;
+	remote->running = false;
 }
 
 Rfcomm::~Rfcomm() {
+	//a running name lookup is not waited for, it keeps remote alive
 	if (connected) {
 		disconnect();
 	}
 }
 
-int Rfcomm::connect(const char *address, const void *param) {
-	struct sockaddr_rc addr;
+int Rfcomm::lookupLocal(const std::string &adapter) {
 	int dev_id;
 	int s;
 
-	if (connected) {
-		disconnect();
+	if (adapter.empty()) {
+		dev_id = hci_get_route(NULL);
+	} else if (adapter.find_first_not_of("0123456789") == std::string::npos) {
+		dev_id = hci_devid(("hci" + adapter).c_str());
+	} else {
+		dev_id = hci_devid(adapter.c_str()); //hciX or mac address
 	}
-
-	dev_id = hci_get_route(NULL);
 	if (dev_id < 0) {
-		LOG(Error) << "Failed finding bluetooth device: " << strerror(errno);
+		LOG(Error) << "Failed finding bluetooth device " << adapter << ": " << strerror(errno);
 		return -1;
 	}
 
 	s = hci_open_dev(dev_id);
-	if (socket < 0) {
+	if (s < 0) {
 		LOG(Error) << "Opening bluetooth device failed: " << strerror(errno);
 		return -1;
 	}
 
-	//rfcomm = malloc(sizeof(*rfcomm));
-
-	if (str2ba(address, (bdaddr_t*)dst_mac) < 0) {
-		LOG(Error) << "Failed reading device bluetooth address: " << strerror(errno);
-		goto err;
-	}
-
-	if (hci_read_local_name(s, 128, src_name, 1000) < 0) {
+	if (hci_read_local_name(s, sizeof(src_name), src_name, 1000) < 0) {
 		LOG(Error) << "Failed reading local bluetooth device name: " << strerror(errno);
 		src_name[0] = '\0';
-		goto err;
+		close(s);
+		return -1;
 	}
 
 	if (hci_read_bd_addr(s, (bdaddr_t*)src_mac, 1000) < 0) {
 		LOG(Error) << "Failed reading local mac address: " << strerror(errno);
-		goto err;
+		close(s);
+		return -1;
 	}
 
-	if (hci_read_remote_name(s, (bdaddr_t*)dst_mac, 128, dst_name, TIMEOUT * 1000) < 0) {
-		LOG(Error) << "Failed reading remote name: " << strerror(errno);
-		goto err;
+	close(s);
+
+	LOG(Debug) << "Local bluetooth device " << dev_id << ": " << src_name;
+	this->adapter = adapter;
+	devId = dev_id;
+	localCached = true;
+	return 0;
+}
+
+int Rfcomm::lookupRemoteName(int devId, const std::shared_ptr<RemoteName> &remote) {
+	uint8_t mac[6];
+	char name[sizeof(remote->name)];
+	int s;
+
+	{
+		LockGuard lock(remote->mutex);
+		memcpy(mac, remote->mac, sizeof(mac));
+	}
+
+	s = hci_open_dev(devId);
+	if (s < 0) {
+		return -1;
 	}
 
+	int ret = hci_read_remote_name(s, (bdaddr_t*)mac, sizeof(name), name, TIMEOUT * 1000);
 	close(s);
+	if (ret < 0) {
+		return -1;
+	}
+
+	LockGuard lock(remote->mutex);
+	if (memcmp(mac, remote->mac, sizeof(mac)) == 0) {
+		memcpy(remote->name, name, sizeof(remote->name));
+		remote->name[sizeof(remote->name) - 1] = '\0';
+		remote->cached = true;
+	}
+	LOG(Info) << "Remote name: " << name;
+
+	return 0;
+}
+
+/*
+ * The lookup can take the whole HCI timeout, so it is detached instead of
+ * joined on disconnect or reconnect. It only touches the shared RemoteName.
+ */
+void Rfcomm::startRemoteNameLookup() {
+	{
+		LockGuard lock(remote->mutex);
+		if (remote->running) {
+			return; //previous lookup still running
+		}
+		remote->running = true;
+	}
+
+	int dev = devId;
+	std::shared_ptr<RemoteName> name = remote;
+	std::thread([dev, name] {
+		if (lookupRemoteName(dev, name) < 0) {
+			LOG(Warning) << "Failed reading remote name: " << strerror(errno);
+		}
+		LockGuard lock(name->mutex);
+		name->running = false;
+	}).detach();
+}
+
+int Rfcomm::connect(const char *address, const void *param) {
+	const pvlib_rfcomm_param *p = static_cast<const pvlib_rfcomm_param*>(param);
+	int remoteName = (p != nullptr) ? p->remote_name : PVLIB_RFCOMM_REMOTE_NAME_BACKGROUND;
+	std::string adapter = (p != nullptr && p->adapter != nullptr) ? p->adapter : "";
+	struct sockaddr_rc addr;
+	uint8_t mac[6];
+	bool nameCached;
+	int s;
+
+	if (connected) {
+		disconnect();
+	}
+
+	if (str2ba(address, (bdaddr_t*)mac) < 0) {
+		LOG(Error) << "Failed reading device bluetooth address: " << strerror(errno);
+		return -1;
+	}
+
+	{
+		LockGuard lock(remote->mutex);
+		if (memcmp(mac, remote->mac, sizeof(mac)) != 0) {
+			memcpy(remote->mac, mac, sizeof(remote->mac));
+			remote->name[0] = '\0';
+			remote->cached = false;
+		}
+		nameCached = remote->cached;
+	}
+
+	//on reconnect go straight to the socket
+	if ((!localCached || adapter != this->adapter) && lookupLocal(adapter) < 0) {
+		return -1;
+	}
+
+	if (remoteName == PVLIB_RFCOMM_REMOTE_NAME_BLOCKING && !nameCached) {
+		if (lookupRemoteName(devId, remote) < 0) {
+			LOG(Error) << "Failed reading remote name: " << strerror(errno);
+			return -1;
+		}
+	}
+
 	s = ::socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
 	if (s < 0) {
 		LOG(Error) << "Failed opening bluetooth socket: " << strerror(errno);
 		return -1;
 	}
 
+	//bind to the local adapter, otherwise the kernel picks the default one
+	memset(&addr, 0, sizeof(addr));
 	addr.rc_family  = AF_BLUETOOTH;
-	addr.rc_channel = 1;
+	addr.rc_channel = 0;
+	memcpy(&addr.rc_bdaddr, src_mac, sizeof(src_mac));
 
-	if (str2ba(address, &addr.rc_bdaddr) < 0) {
-		goto err;
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		LOG(Error) << "Failed binding to local adapter: " << strerror(errno);
+		close(s);
+		localCached = false;
+		return -1;
 	}
 
+	memset(&addr, 0, sizeof(addr));
+	addr.rc_family  = AF_BLUETOOTH;
+	addr.rc_channel = 1;
+	memcpy(&addr.rc_bdaddr, mac, sizeof(mac));
+
 	if (::connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 		LOG(Error) << "Failed connecting to remote: " << strerror(errno);
-		goto err;
+		close(s);
+		localCached = false; //adapter might have changed
+		return -1;
 	}
 
 	socket = s;
 	connected = true;
 	LOG(Info) << "RFCOMM: Successfully established connection.";
-	return 0;
 
-err:
-	close(s);
-	return -1;
+	if (remoteName == PVLIB_RFCOMM_REMOTE_NAME_BACKGROUND && !nameCached) {
+		startRemoteNameLookup();
+	}
+
+	return 0;
 }
 
 
 
 int Rfcomm::write(const uint8_t *data, int len, const std::string& to)
 {
-	return send(socket, data, len, 0);
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	return writev(&iov, 1, to);
+}
+
+int Rfcomm::writev(const struct iovec *iov, int iovcnt, const std::string& to)
+{
+	int ret = sendAll(socket, iov, iovcnt);
+	if (ret < 0) {
+		LOG(Error) << "Error writing data: " << strerror(errno);
+	}
+	return ret;
 }
 
 int Rfcomm::read(uint8_t *data, int max_len, std::string& from)
@@ -185,6 +317,8 @@ int Rfcomm::read(uint8_t *data, int max_len, std::string& from)
 void Rfcomm::disconnect() {
 	if (connected) {
 		close(socket);
+		socket = -1;
+		connected = false;
 	}
 }
 
@@ -22,6 +22,7 @@
 #define RFCOMM_H
 
 #include <memory>
+#include <mutex>
 
 #include "connection.h"
 #include "utility.h"
@@ -42,15 +43,38 @@ public:
 
 	virtual int write(const uint8_t *data, int len, const std::string &to) override;
 
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
 	virtual int read(uint8_t *data, int max_len, std::string& from) override;
+
+	virtual int readFd() const override { return connected ? socket : -1; }
 private:
+	int lookupLocal(const std::string &adapter);
+
+	/* remote identity, shared with a detached background lookup */
+	struct RemoteName {
+		std::mutex mutex;
+		uint8_t mac[6];
+		char name[128];
+		bool cached;
+		bool running; //< background lookup in progress
+	};
+
+	static int lookupRemoteName(int devId, const std::shared_ptr<RemoteName> &remote);
+
+	void startRemoteNameLookup();
+
 	bool connected;
 	int timeout;
 	int socket;
 	uint8_t src_mac[6];
-	uint8_t dst_mac[6];
 	char src_name[128];
-	char dst_name[128];
+
+	/* identities are cached for fast reconnects */
+	std::string adapter;
+	int devId;
+	bool localCached;
+	std::shared_ptr<RemoteName> remote;
 };
 
 } //namespace pvlib {
@@ -0,0 +1,210 @@
+/*
+ *   Pvlib - Single producer single consumer ring
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef RING_H
+#define RING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "utility.h"
+
+namespace pvlib {
+
+/**
+ * Lock free ring of preallocated slots for one producer and one consumer thread.
+ *
+ * A side can block in wait or waitSpace, the other side only signals the
+ * eventfd if it is actually sleeping, so a busy pair costs no syscalls.
+ */
+template<typename T>
+class Ring {
+public:
+	DISABLE_COPY(Ring)
+
+	/**
+	 * @param capacity number of slots, rounded up to a power of two.
+	 */
+	explicit Ring(size_t capacity) :
+			mask(0),
+			head(0),
+			tail(0),
+			consumerSleeping(false),
+			producerSleeping(false) {
+		dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		resize(capacity);
+	}
+
+	~Ring() {
+		if (dataFd >= 0) close(dataFd);
+		if (spaceFd >= 0) close(spaceFd);
+	}
+
+	size_t capacity() const { return mask + 1; }
+
+	/**
+	 * Change capacity, drops all elements. Only allowed while neither side is active.
+	 */
+	void resize(size_t capacity) {
+		size_t n = 1;
+		while (n < capacity) {
+			n <<= 1;
+		}
+		slots.reset(new T[n]);
+		mask = n - 1;
+		head.store(0);
+		tail.store(0);
+	}
+
+	/**
+	 * Producer: append element.
+	 *
+	 * @return false if the ring is full, element is left untouched.
+	 */
+	bool push(T &&value) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask) {
+			return false;
+		}
+
+		slots[t & mask] = std::move(value);
+		tail.store(t + 1, std::memory_order_release);
+
+		//pairs with the fence in wait, either we see the consumer sleeping or it sees the element
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (consumerSleeping.load(std::memory_order_relaxed)) {
+			signal(dataFd);
+		}
+		return true;
+	}
+
+	/**
+	 * Consumer: take oldest element.
+	 *
+	 * @return false if the ring is empty.
+	 */
+	bool pop(T &value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		value = std::move(slots[h & mask]);
+		head.store(h + 1, std::memory_order_release);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (producerSleeping.load(std::memory_order_relaxed)) {
+			signal(spaceFd);
+		}
+		return true;
+	}
+
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	bool empty() const { return size() == 0; }
+
+	/**
+	 * Consumer: block until an element is available, wake is called or timeout ms passed.
+	 *
+	 * Spurious returns are possible, check with pop.
+	 * @return > 0 if elements are available, else 0.
+	 */
+	int wait(int timeout) {
+		sleep(consumerSleeping, dataFd, timeout, [this] { return empty(); });
+		return empty() ? 0 : 1;
+	}
+
+	/**
+	 * Producer: block until a slot is free, wake is called or timeout ms passed.
+	 *
+	 * @return > 0 if a slot is free, else 0.
+	 */
+	int waitSpace(int timeout) {
+		sleep(producerSleeping, spaceFd, timeout, [this] { return size() > mask; });
+		return (size() > mask) ? 0 : 1;
+	}
+
+	/**
+	 * Wake up both sides, e.g. on shutdown.
+	 */
+	void wake() {
+		signal(dataFd);
+		signal(spaceFd);
+	}
+
+	/**
+	 * Drop all elements, only allowed while no producer is running.
+	 */
+	void clear() {
+		T value;
+		while (pop(value)) {}
+	}
+
+private:
+	template<typename Blocked>
+	void sleep(std::atomic_bool &sleeping, int fd, int timeout, Blocked blocked) {
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (blocked()) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			//without eventfd fall back to polling in short intervals
+			int ret = (fd >= 0) ? poll(&pfd, 1, timeout) : poll(nullptr, 0, std::min(timeout, 1));
+			if (ret > 0) {
+				uint64_t count;
+				while (::read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+			}
+		}
+
+		sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	static void signal(int fd) {
+		uint64_t one = 1;
+		if (fd >= 0) {
+			while (::write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+		}
+	}
+
+	std::unique_ptr<T[]> slots;
+	size_t mask;
+	std::atomic<size_t> head; //< written by consumer
+	uint8_t padding[64];      //< keep indices on separate cache lines
+	std::atomic<size_t> tail; //< written by producer
+	std::atomic_bool consumerSleeping;
+	std::atomic_bool producerSleeping;
+	int dataFd;
+	int spaceFd;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef RING_H */
@@ -0,0 +1,229 @@
+/*
+ *   Pvlib - Serial connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "serial"
+
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "connection.h"
+#include "log.h"
+#include "pvlib.h"
+#include "serial.h"
+
+namespace pvlib {
+
+const static int TIMEOUT = 5; /* in milliseconds */
+
+static const struct {
+	int baudrate;
+	speed_t speed;
+} baudrates[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 921600, B921600 }
+};
+
+Serial::Serial() :
+		connected(false),
+		timeout(TIMEOUT),
+		fd(-1),
+		saved{} {
+
+}
+
+Serial::~Serial() {
+	if (connected) {
+		disconnect();
+	}
+}
+
+int Serial::configure(int baudrate, int vmin, int vtime) {
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) < 0) {
+		LOG(Error) << "Failed reading terminal attributes: " << strerror(errno);
+		return -1;
+	}
+	saved = tio;
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+
+	if (baudrate > 0) {
+		bool found = false;
+		for (const auto &b : baudrates) {
+			if (b.baudrate == baudrate) {
+				cfsetispeed(&tio, b.speed);
+				cfsetospeed(&tio, b.speed);
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			LOG(Error) << "Unsupported baudrate: " << baudrate;
+			return -1;
+		}
+	}
+
+	//with vmin but no vtime a short frame would block read forever
+	if (vmin > 0 && vtime <= 0) {
+		LOG(Warning) << "vmin without vtime, using vtime 1";
+		vtime = 1;
+	}
+	tio.c_cc[VMIN] = static_cast<cc_t>(std::min(vmin, 255));
+	tio.c_cc[VTIME] = static_cast<cc_t>(std::min(vtime, 255));
+
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		LOG(Error) << "Failed setting terminal attributes: " << strerror(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int Serial::connect(const char *address, const void *param) {
+	const pvlib_serial_param *p = static_cast<const pvlib_serial_param*>(param);
+	int baudrate = (p != nullptr) ? p->baudrate : 0;
+	int vmin = (p != nullptr) ? p->vmin : 0;
+	int vtime = (p != nullptr) ? p->vtime : 0;
+
+	if (connected) {
+		disconnect();
+	}
+
+	if (address == nullptr || address[0] == '\0') {
+		LOG(Error) << "No device given!";
+		return -1;
+	}
+
+	//without CLOCAL open would wait for carrier, it is set by configure
+	fd = open(address, O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0) {
+		LOG(Error) << "Failed opening " << address << ": " << strerror(errno);
+		return -1;
+	}
+
+	if (!isatty(fd)) {
+		LOG(Error) << address << " is not a terminal device!";
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	if (configure(baudrate, vmin, vtime) < 0) {
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	//reads block for vmin and vtime
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		LOG(Error) << "Failed clearing O_NONBLOCK: " << strerror(errno);
+		tcsetattr(fd, TCSANOW, &saved);
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	connected = true;
+	LOG(Info) << "Serial: Successfully opened " << address;
+	return 0;
+}
+
+int Serial::write(const uint8_t *data, int len, const std::string& to)
+{
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	return writev(&iov, 1, to);
+}
+
+int Serial::writev(const struct iovec *iov, int iovcnt, const std::string& to)
+{
+	int ret = writeAll(fd, iov, iovcnt);
+	if (ret < 0) {
+		LOG(Error) << "Error writing data: " << strerror(errno);
+	}
+	return ret;
+}
+
+int Serial::read(uint8_t *data, int max_len, std::string& from)
+{
+	struct timeval tv;
+	fd_set rdfds;
+
+	FD_ZERO(&rdfds);
+	FD_SET(fd, &rdfds);
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if (select(fd + 1, &rdfds, NULL, NULL, &tv) < 0) {
+		LOG(Error) << "serial select error!";
+		return -1;
+	}
+
+	if (FD_ISSET(fd, &rdfds)) {
+		//blocks until vmin bytes or vtime passed without a byte
+		int ret = ::read(fd, data, max_len);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN) return 0;
+			LOG(Error) << "Error reading data: " << strerror(errno);
+			return -1;
+		} else if (ret == 0) {
+			LOG(Error) << "Device hung up!";
+			return -1;
+		}
+		return ret;
+	} else {
+		return 0;
+	}
+}
+
+void Serial::disconnect() {
+	if (connected) {
+		tcsetattr(fd, TCSANOW, &saved);
+		close(fd);
+		fd = -1;
+		connected = false;
+	}
+}
+
+static Connection *createSerial() {
+	return new Serial();
+}
+
+extern const ConnectionInfo serialConnectionInfo;
+const ConnectionInfo serialConnectionInfo(createSerial, "serial", "pvlogdev,", "tty device like /dev/rfcomm0 or a rs485 converter");
+
+} //namespace pvlib {
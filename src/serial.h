@@ -0,0 +1,69 @@
+/*
+ *   Pvlib - Serial connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <termios.h>
+
+#include "connection.h"
+#include "utility.h"
+
+namespace pvlib {
+
+/**
+ * Connection to a character device, e.g. /dev/rfcomm0 bound by the kernel
+ * or a RS485/USB converter.
+ *
+ * Address is the device path. The device is switched to raw mode, VMIN and
+ * VTIME of pvlib_serial_param let the kernel batch received bytes, so a
+ * frame arrives in few reads instead of one per byte.
+ */
+class Serial : public Connection {
+public:
+	DISABLE_COPY(Serial)
+
+	Serial();
+
+	virtual ~Serial() override;
+
+	virtual int connect(const char *address, const void *param) override;
+
+	virtual void disconnect() override;
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int max_len, std::string& from) override;
+
+	virtual int readFd() const override { return connected ? fd : -1; }
+private:
+	int configure(int baudrate, int vmin, int vtime);
+
+	bool connected;
+	int timeout;
+	int fd;
+	struct termios saved;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef SERIAL_H */
@@ -0,0 +1,598 @@
+/*
+ *   Pvlib - Simulated plant connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "simulation"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <algorithm>
+
+#include "byte.h"
+#include "connection.h"
+#include "log.h"
+#include "simulation.h"
+
+namespace pvlib {
+
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+
+const static int TIMEOUT = 5; /* in milliseconds */
+const static int MAX_INVERTERS = 16;
+
+static const int BT_HEADER_SIZE = 18;
+static const int BT_MAX_DATA = 0xff - BT_HEADER_SIZE;
+static const int SMADATA2PLUS_HEADER_SIZE = 24;
+
+static const uint8_t HDLC_ESC  = 0x7d;
+static const uint8_t HDLC_SYNC = 0x7e;
+static const uint32_t ACCM = 0x000E0000;
+static const uint8_t SMANET_HEADER[4] = { 0xff, 0x03, 0x60, 0x65 };
+
+static const uint16_t PPPINITFCS16 = 0xffff;
+static const uint16_t PPPGOODFCS16 = 0xf0b8;
+
+static const uint32_t SERIAL_BROADCAST = 0xffffffff;
+static const uint32_t SERIAL_BASE = 2130000000;
+static const uint16_t SYSID = 0x0083;
+
+static const uint8_t MAC_NULL[6] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t MAC_BROADCAST[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const uint8_t MAC_LOCAL[6] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+static const uint8_t MAC_INVERTER[6] = { 0x00, 0x5a, 0x33, 0x80, 0x25, 0x00 };
+
+static const int ARCHIVE_DAYS = 30;
+static const int DAY_ENTRIES_PER_PACKET = 20;
+static const int EVENT_ENTRIES_PER_PACKET = 4;
+
+/*
+ * Bitwise FCS-16 calculation. Deliberately independent of the table driven
+ * implementation in smanet.cpp, so the simulation checks it.
+ */
+static uint16_t fcs16(uint16_t fcs, const uint8_t *buf, int len) {
+	while (len--) {
+		fcs ^= *buf++;
+		for (int i = 0; i < 8; ++i) {
+			fcs = (fcs & 1) ? (fcs >> 1) ^ 0x8408 : (fcs >> 1);
+		}
+	}
+	return fcs;
+}
+
+static void escape(std::vector<uint8_t> &out, const uint8_t *in, int len) {
+	for (int i = 0; i < len; ++i) {
+		uint8_t c = in[i];
+		if (c == HDLC_ESC || c == HDLC_SYNC || ((c < 0x20) && (ACCM & (1 << c)))) {
+			out.push_back(HDLC_ESC);
+			out.push_back(c ^ 0x20);
+		} else {
+			out.push_back(c);
+		}
+	}
+}
+
+static void storeRecordHeader(uint8_t *buf, uint8_t cnt, uint16_t idx, uint8_t type, uint32_t time) {
+	buf[0] = cnt;
+	byte::storeU16le(buf + 1, idx);
+	buf[3] = type;
+	byte::storeU32le(buf + 4, time);
+}
+
+static void addRecord1(std::vector<uint8_t> &out, uint8_t cnt, uint16_t idx, uint32_t time, uint32_t value) {
+	uint8_t buf[28];
+	storeRecordHeader(buf, cnt, idx, 0x00, time);
+	for (int i = 0; i < 4; ++i) {
+		byte::storeU32le(buf + 8 + 4 * i, value);
+	}
+	byte::storeU32le(buf + 24, 1);
+	out.insert(out.end(), buf, buf + sizeof(buf));
+}
+
+static void addRecord2(std::vector<uint8_t> &out, uint16_t idx, uint32_t time, uint64_t value) {
+	uint8_t buf[16];
+	storeRecordHeader(buf, 0x01, idx, 0x00, time);
+	byte::storeU64le(buf + 8, value);
+	out.insert(out.end(), buf, buf + sizeof(buf));
+}
+
+static void addRecord3(std::vector<uint8_t> &out, uint16_t idx, uint8_t type, uint32_t time, const uint8_t *data) {
+	uint8_t buf[40];
+	storeRecordHeader(buf, 0x01, idx, type, time);
+	memcpy(buf + 8, data, 32);
+	out.insert(out.end(), buf, buf + sizeof(buf));
+}
+
+static void addAttributeRecord(std::vector<uint8_t> &out, uint16_t idx, uint32_t time, uint32_t attribute) {
+	uint8_t data[32];
+	byte::storeU32le(data, attribute | 0x01000000); //selected
+	for (int i = 4; i < 32; i += 4) {
+		byte::storeU32le(data + i, 0x00fffffe);
+	}
+	addRecord3(out, idx, 0x08, time, data);
+}
+
+Simulation::Simulation() :
+		connected(false),
+		interrupted(false),
+		timeout(TIMEOUT),
+		startTime(0) {
+	memset(mac, 0, sizeof(mac));
+}
+
+Simulation::~Simulation() {
+	if (connected) {
+		disconnect();
+	}
+}
+
+int Simulation::connect(const char *address, const void *param) {
+	int num = 1;
+
+	if (connected) {
+		disconnect();
+	}
+
+	if (address != nullptr && address[0] != '\0') {
+		num = atoi(address);
+		if (num < 1 || num > MAX_INVERTERS) {
+			LOG(Error) << "Invalid number of simulated inverters: " << address;
+			return -1;
+		}
+	}
+
+	UniqueLock lock(mutex);
+
+	inverters.clear();
+	for (int i = 0; i < num; ++i) {
+		Inverter inv;
+		memcpy(inv.mac, MAC_INVERTER, 6);
+		inv.mac[5] = static_cast<uint8_t>(i);
+		inv.sysId = SYSID;
+		inv.serial = SERIAL_BASE + i;
+		inverters.push_back(inv);
+	}
+
+	memcpy(mac, MAC_LOCAL, 6);
+	txBuf.clear();
+	smanetBuf.clear();
+	rxBuf.clear();
+	startTime = time(nullptr);
+
+	//Inverter starts the handshake
+	const uint8_t hello[13] = { 0x00, 0x04, 0x70, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 };
+	sendBluetooth(0x02, inverters[0].mac, MAC_NULL, hello, sizeof(hello));
+
+	connected = true;
+	LOG(Info) << "Simulating plant with " << num << " inverters.";
+	return 0;
+}
+
+void Simulation::disconnect() {
+	LockGuard lock(mutex);
+	connected = false;
+	rxBuf.clear();
+}
+
+void Simulation::sendBluetooth(uint8_t cmd, const uint8_t *src, const uint8_t *dst, const uint8_t *data, int len) {
+	uint8_t header[BT_HEADER_SIZE];
+
+	assert(len <= BT_MAX_DATA);
+
+	header[0] = 0x7e;
+	header[1] = static_cast<uint8_t>(len + BT_HEADER_SIZE);
+	header[2] = 0x00;
+	header[3] = header[0] ^ header[1] ^ header[2];
+	memcpy(header + 4, src, 6);
+	memcpy(header + 10, dst, 6);
+	header[16] = cmd;
+	header[17] = 0x00;
+
+	rxBuf.insert(rxBuf.end(), header, header + BT_HEADER_SIZE);
+	rxBuf.insert(rxBuf.end(), data, data + len);
+	event.notify_all();
+}
+
+void Simulation::sendSmadata2plus(const Inverter &inv, const Request &req, const uint8_t *data, int len,
+		uint16_t packetNum) {
+	uint8_t header[SMADATA2PLUS_HEADER_SIZE];
+	std::vector<uint8_t> frame;
+
+	assert(len % 4 == 0);
+
+	memset(header, 0, sizeof(header));
+	header[0] = static_cast<uint8_t>((len + SMADATA2PLUS_HEADER_SIZE) / 4);
+	header[1] = req.ctrl;
+	byte::storeU16le(header + 2, req.srcSysId);
+	byte::storeU32le(header + 4, req.srcSerial);
+	header[9] = req.flag;
+	byte::storeU16le(header + 10, inv.sysId);
+	byte::storeU32le(header + 12, inv.serial);
+	byte::storeU16le(header + 20, packetNum);
+	byte::storeU16le(header + 22, req.transactionCntr);
+
+	uint16_t fcs = fcs16(PPPINITFCS16, SMANET_HEADER, sizeof(SMANET_HEADER));
+	fcs = fcs16(fcs, header, sizeof(header));
+	fcs = fcs16(fcs, data, len);
+	fcs ^= 0xffff;
+	uint8_t fcsBuf[2] = { static_cast<uint8_t>(fcs & 0xff), static_cast<uint8_t>(fcs >> 8) };
+
+	frame.push_back(HDLC_SYNC);
+	escape(frame, SMANET_HEADER, sizeof(SMANET_HEADER));
+	escape(frame, header, sizeof(header));
+	escape(frame, data, len);
+	escape(frame, fcsBuf, sizeof(fcsBuf));
+	frame.push_back(HDLC_SYNC);
+
+	//split into bluetooth packets, all but the last one are sent with cmd 0x08
+	for (size_t pos = 0; pos < frame.size(); pos += BT_MAX_DATA) {
+		int size = std::min(static_cast<int>(frame.size() - pos), BT_MAX_DATA);
+		uint8_t cmd = (pos + size < frame.size()) ? 0x08 : 0x01;
+		sendBluetooth(cmd, inv.mac, mac, frame.data() + pos, size);
+	}
+}
+
+void Simulation::answerChannel(const Inverter &inv, const Request &req, uint16_t object) {
+	std::vector<uint8_t> out;
+	uint32_t now = static_cast<uint32_t>(time(nullptr));
+	int idx = static_cast<int>(inv.serial - SERIAL_BASE);
+
+	out.resize(12);
+	out[0] = 0x01;
+	out[1] = 0x02;
+	byte::storeU16le(&out[2], object);
+
+	switch (object) {
+	case 0x0000: //device discovery
+		break;
+	case 0x5100: { //ac spot values
+		uint32_t power = 1500 + 100 * idx;
+		addRecord1(out, 1, 0x263f, now, power);
+		for (uint8_t phase = 0; phase < 3; ++phase) {
+			addRecord1(out, 1, 0x4640 + phase, now, power / 3);
+		}
+		for (uint8_t phase = 0; phase < 3; ++phase) {
+			addRecord1(out, 1, 0x4648 + phase, now, 23000 + 10 * phase);
+		}
+		for (uint8_t phase = 0; phase < 3; ++phase) {
+			addRecord1(out, 1, 0x4650 + phase, now, power * 1000 / 3 / 230);
+		}
+		addRecord1(out, 1, 0x4657, now, 5000);
+		break;
+	}
+	case 0x5380: //dc spot values
+		for (uint8_t tracker = 1; tracker <= 2; ++tracker) {
+			addRecord1(out, tracker, 0x251e, now, 800 + 50 * idx);
+			addRecord1(out, tracker, 0x451f, now, 35000);
+			addRecord1(out, tracker, 0x4521, now, (800 + 50 * idx) * 1000 / 350);
+		}
+		break;
+	case 0x5400: //statistics
+		addRecord2(out, 0x2601, now, 1000000 + 10000 * idx);
+		addRecord2(out, 0x2622, now, 5000);
+		addRecord2(out, 0x462E, now, 36000000);
+		addRecord2(out, 0x462F, now, 35000000);
+		break;
+	case 0x5180: //device status
+		addAttributeRecord(out, 0x2148, now, 307);
+		break;
+	case 0x5800: { //inverter info
+		uint8_t data[32];
+
+		memset(data, 0, sizeof(data));
+		snprintf(reinterpret_cast<char*>(data), sizeof(data), "SN: %u", inv.serial);
+		addRecord3(out, 0x821E, 0x10, now, data);
+		addAttributeRecord(out, 0x821F, now, 8001);
+		addAttributeRecord(out, 0x8220, now, 9074);
+
+		memset(data, 0, sizeof(data));
+		data[16] = 4; //release
+		data[17] = 50;
+		data[18] = 5;
+		data[19] = 2;
+		addRecord3(out, 0x8234, 0x00, now, data);
+		break;
+	}
+	default:
+		LOG(Warning) << "Unsupported object: " << std::hex << object;
+		return;
+	}
+
+	sendSmadata2plus(inv, req, out.data(), out.size(), 0);
+}
+
+void Simulation::answerArchive(const Inverter &inv, const Request &req, uint16_t object) {
+	if (req.len < 12) {
+		return;
+	}
+
+	time_t now = time(nullptr);
+	time_t from = byte::parseU32le(req.data + 4);
+	time_t to = byte::parseU32le(req.data + 8);
+	time_t today = now - now % (24 * 60 * 60);
+	int idx = static_cast<int>(inv.serial - SERIAL_BASE);
+
+	bool events = (object != 0x7020);
+	int entrySize = events ? 48 : 12;
+	int perPacket = events ? EVENT_ENTRIES_PER_PACKET : DAY_ENTRIES_PER_PACKET;
+
+	std::vector<uint8_t> entries;
+	for (int day = ARCHIVE_DAYS; day >= 0; --day) {
+		time_t t = today - day * 24 * 60 * 60 + (events ? 12 * 60 * 60 : 0);
+		if (t < from || t > to || t > now) {
+			continue;
+		}
+
+		uint8_t buf[48];
+		memset(buf, 0, sizeof(buf));
+		if (events) {
+			byte::storeU32le(buf, t);
+			byte::storeU16le(buf + 4, ARCHIVE_DAYS - day);
+			byte::storeU16le(buf + 6, inv.sysId);
+			byte::storeU32le(buf + 8, inv.serial);
+			byte::storeU16le(buf + 12, 10000 + day);
+			byte::storeU32le(buf + 24, 301); //tag
+		} else {
+			byte::storeU32le(buf, t);
+			byte::storeU64le(buf + 4, 1000000 + 10000 * idx + 5000 * (ARCHIVE_DAYS - day));
+		}
+		entries.insert(entries.end(), buf, buf + entrySize);
+	}
+
+	int entryNum = entries.size() / entrySize;
+	int packets = std::max(1, (entryNum + perPacket - 1) / perPacket);
+	for (int packet = 0; packet < packets; ++packet) {
+		int first = packet * perPacket;
+		int num = std::min(perPacket, entryNum - first);
+		std::vector<uint8_t> out(12);
+
+		out[0] = 0x01;
+		out[1] = 0x02;
+		byte::storeU16le(&out[2], object);
+		byte::storeU32le(&out[4], first);
+		byte::storeU32le(&out[8], first + std::max(num, 1) - 1);
+		if (num > 0) {
+			out.insert(out.end(), entries.begin() + first * entrySize,
+					entries.begin() + (first + num) * entrySize);
+		}
+
+		sendSmadata2plus(inv, req, out.data(), out.size(), packets - packet - 1);
+	}
+}
+
+void Simulation::answerTime(const Inverter &inv, const Request &req) {
+	uint8_t buf[40];
+	uint32_t now = static_cast<uint32_t>(time(nullptr));
+
+	byte::storeU32le(buf, 0xf000020b);
+	byte::storeU32le(buf + 4, 0x00236d00);
+	byte::storeU32le(buf + 8, 0x00236d00);
+	byte::storeU32le(buf + 12, 0x00236d00);
+	byte::storeU32le(buf + 16, now);
+	byte::storeU32le(buf + 20, static_cast<uint32_t>(startTime));
+	byte::storeU32le(buf + 24, now);
+	byte::storeU32le(buf + 28, 3600);
+	byte::storeU32le(buf + 32, 17);
+	byte::storeU32le(buf + 36, 1);
+
+	sendSmadata2plus(inv, req, buf, sizeof(buf), 0);
+}
+
+void Simulation::handleRequest(const Inverter &inv, const Request &req) {
+	uint8_t cmd = req.data[0];
+	uint8_t type = req.data[1];
+	uint16_t object = byte::parseU16le(req.data + 2);
+	bool broadcast = (req.dstSerial == SERIAL_BROADCAST);
+	bool first = (&inv == &inverters.front());
+
+	if (object == 0xfffd) { //logon, logoff
+		if (cmd == 0x0c && type == 0x04) {
+			std::vector<uint8_t> out(req.data, req.data + req.len);
+			out[0] = 0x0d;
+			sendSmadata2plus(inv, req, out.data(), out.size(), 0);
+		}
+	} else if (object == 0xf000) { //time
+		bool query = true;
+		for (int i = 16; i < 32 && i < req.len; ++i) {
+			if (req.data[i] != 0) query = false;
+		}
+		if (cmd == 0x0a && type == 0x02 && query && first) {
+			answerTime(inv, req);
+		}
+	} else if (cmd == 0x00 && type == 0x02) {
+		if (object >= 0x7000) {
+			answerArchive(inv, req, object);
+		} else if (!broadcast || object == 0x0000 || first) {
+			//only device discovery is answered by every inverter,
+			//otherwise replies would pile up for requests expecting a single answer
+			answerChannel(inv, req, object);
+		}
+	} else {
+		LOG(Warning) << "Unsupported request: " << print_array(req.data, 4);
+	}
+}
+
+void Simulation::handleSmanet(const uint8_t *frame, int len) {
+	std::vector<uint8_t> buf;
+
+	buf.reserve(len);
+	for (int i = 0; i < len; ++i) {
+		if (frame[i] == HDLC_ESC && i + 1 < len) {
+			buf.push_back(frame[++i] ^ 0x20);
+		} else {
+			buf.push_back(frame[i]);
+		}
+	}
+
+	if (buf.size() < sizeof(SMANET_HEADER) + SMADATA2PLUS_HEADER_SIZE + 4 + 2) {
+		LOG(Error) << "Dropping short smanet frame.";
+		return;
+	}
+
+	if (fcs16(PPPINITFCS16, buf.data(), buf.size()) != PPPGOODFCS16) {
+		LOG(Error) << "Dropping smanet frame with invalid fcs.";
+		return;
+	}
+
+	if (memcmp(buf.data(), SMANET_HEADER, sizeof(SMANET_HEADER)) != 0) {
+		LOG(Error) << "Dropping smanet frame of unknown protocol.";
+		return;
+	}
+
+	const uint8_t *h = buf.data() + sizeof(SMANET_HEADER);
+	Request req;
+	req.ctrl = h[1];
+	req.dstSerial = byte::parseU32le(h + 4);
+	req.flag = h[9];
+	req.srcSysId = byte::parseU16le(h + 10);
+	req.srcSerial = byte::parseU32le(h + 12);
+	req.transactionCntr = byte::parseU16le(h + 22);
+	req.data = h + SMADATA2PLUS_HEADER_SIZE;
+	req.len = buf.size() - sizeof(SMANET_HEADER) - SMADATA2PLUS_HEADER_SIZE - 2;
+
+	for (const Inverter &inv : inverters) {
+		if (req.dstSerial == SERIAL_BROADCAST || req.dstSerial == inv.serial) {
+			handleRequest(inv, req);
+		}
+	}
+}
+
+void Simulation::handleBluetooth(const uint8_t *frame, int len) {
+	uint8_t cmd = frame[16];
+	const uint8_t *dst = frame + 10;
+	const uint8_t *data = frame + BT_HEADER_SIZE;
+	int dataLen = len - BT_HEADER_SIZE;
+
+	switch (cmd) {
+	case 0x01:
+	case 0x08: {
+		smanetBuf.insert(smanetBuf.end(), data, data + dataLen);
+
+		auto start = smanetBuf.begin();
+		for (;;) {
+			start = std::find_if(start, smanetBuf.end(), [](uint8_t c) { return c != HDLC_SYNC; });
+			auto end = std::find(start, smanetBuf.end(), HDLC_SYNC);
+			if (end == smanetBuf.end()) {
+				break;
+			}
+			handleSmanet(&*start, end - start);
+			start = end;
+		}
+		smanetBuf.erase(smanetBuf.begin(), start);
+		break;
+	}
+	case 0x02: { //handshake answer, send own and inverter mac and the device list
+		uint8_t buf[8 * (MAX_INVERTERS + 1)];
+
+		memcpy(buf, inverters[0].mac, 6);
+		buf[6] = 0x00;
+		memcpy(buf + 7, mac, 6);
+		sendBluetooth(0x0a, inverters[0].mac, MAC_BROADCAST, buf, 13);
+
+		memcpy(buf, mac, 6);
+		buf[6] = 0x01;
+		buf[7] = 0x01;
+		for (size_t i = 0; i < inverters.size(); ++i) {
+			memcpy(buf + 8 * (i + 1), inverters[i].mac, 6);
+			buf[8 * (i + 1) + 6] = 0x01;
+			buf[8 * (i + 1) + 7] = 0x01;
+		}
+		sendBluetooth(0x05, inverters[0].mac, mac, buf, 8 * (inverters.size() + 1));
+		break;
+	}
+	case 0x03: { //signal strength
+		const Inverter *inv = &inverters[0];
+		for (const Inverter &i : inverters) {
+			if (memcmp(i.mac, dst, 6) == 0) inv = &i;
+		}
+		uint8_t buf[6] = { 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
+		buf[4] = static_cast<uint8_t>(0xc0 - 0x10 * (inv - &inverters[0]));
+		sendBluetooth(0x04, inv->mac, mac, buf, sizeof(buf));
+		break;
+	}
+	default:
+		LOG(Warning) << "Unsupported bluetooth cmd: " << std::hex << (int)cmd;
+		break;
+	}
+}
+
+int Simulation::write(const uint8_t *data, int len, const std::string &to) {
+	LockGuard lock(mutex);
+
+	if (!connected) {
+		return -1;
+	}
+
+	txBuf.insert(txBuf.end(), data, data + len);
+
+	while (txBuf.size() >= BT_HEADER_SIZE) {
+		if (txBuf[0] != 0x7e || (txBuf[0] ^ txBuf[1] ^ txBuf[2] ^ txBuf[3]) || txBuf[1] < BT_HEADER_SIZE) {
+			LOG(Error) << "Invalid bluetooth header!";
+			txBuf.clear();
+			return -1;
+		}
+
+		size_t frameLen = txBuf[1];
+		if (txBuf.size() < frameLen) {
+			break;
+		}
+
+		handleBluetooth(txBuf.data(), frameLen);
+		txBuf.erase(txBuf.begin(), txBuf.begin() + frameLen);
+	}
+
+	return len;
+}
+
+int Simulation::read(uint8_t *data, int max_len, std::string &from) {
+	UniqueLock lock(mutex);
+
+	if (!connected) {
+		return -1;
+	}
+
+	if (rxBuf.empty()) {
+		event.wait_for(lock, std::chrono::milliseconds(timeout), [this] { return !rxBuf.empty() || interrupted; });
+	}
+	interrupted = false;
+
+	int len = std::min(static_cast<int>(rxBuf.size()), max_len);
+	std::copy(rxBuf.begin(), rxBuf.begin() + len, data);
+	rxBuf.erase(rxBuf.begin(), rxBuf.begin() + len);
+
+	return len;
+}
+
+void Simulation::interrupt() {
+	LockGuard lock(mutex);
+	interrupted = true;
+	event.notify_all();
+}
+
+static Connection *createSimulation() {
+	return new Simulation();
+}
+
+extern const ConnectionInfo simulationConnectionInfo;
+const ConnectionInfo simulationConnectionInfo(createSimulation, "sim", "pvlogdev,", "simulated plant for testing");
+
+} //namespace pvlib {
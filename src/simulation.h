@@ -0,0 +1,118 @@
+/*
+ *   Pvlib - Simulated plant connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "connection.h"
+#include "utility.h"
+
+namespace pvlib {
+
+/**
+ * In process simulation of a sma bluetooth plant.
+ *
+ * Answers the smabluetooth handshake, smanet framing and the smadata2plus
+ * objects used by pvlib, so the whole protocol stack can be run and profiled
+ * without bluetooth hardware.
+ *
+ * The address passed to connect is the number of simulated inverters,
+ * if empty one inverter is simulated.
+ */
+class Simulation : public Connection {
+public:
+	DISABLE_COPY(Simulation)
+
+	Simulation();
+
+	virtual ~Simulation() override;
+
+	virtual int connect(const char *address, const void *param) override;
+
+	virtual void disconnect() override;
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int max_len, std::string &from) override;
+
+	virtual void interrupt() override;
+
+private:
+	struct Inverter {
+		uint8_t  mac[6];
+		uint16_t sysId;
+		uint32_t serial;
+	};
+
+	struct Request {
+		uint8_t  ctrl;
+		uint8_t  flag;
+		uint16_t srcSysId;
+		uint32_t srcSerial;
+		uint32_t dstSerial;
+		uint16_t transactionCntr;
+		const uint8_t *data;
+		int len;
+	};
+
+	void handleBluetooth(const uint8_t *frame, int len);
+
+	void handleSmanet(const uint8_t *frame, int len);
+
+	void handleRequest(const Inverter &inv, const Request &req);
+
+	void answerChannel(const Inverter &inv, const Request &req, uint16_t object);
+
+	void answerArchive(const Inverter &inv, const Request &req, uint16_t object);
+
+	void answerTime(const Inverter &inv, const Request &req);
+
+	void sendBluetooth(uint8_t cmd, const uint8_t *src, const uint8_t *dst, const uint8_t *data, int len);
+
+	void sendSmadata2plus(const Inverter &inv, const Request &req, const uint8_t *data, int len,
+			uint16_t packetNum);
+
+	std::mutex mutex;
+	std::condition_variable event;
+
+	bool connected;
+	bool interrupted;
+	int timeout;
+
+	uint8_t mac[6];
+	std::vector<Inverter> inverters;
+
+	std::vector<uint8_t> txBuf;     //< partially written bluetooth frames
+	std::vector<uint8_t> smanetBuf; //< smanet stream of smadata2plus packets
+	std::deque<uint8_t> rxBuf;      //< data not read yet
+
+	time_t startTime;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef SIMULATION_H */
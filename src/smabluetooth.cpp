@@ -21,11 +21,16 @@
 #define PVLIB_LOG_MODULE "smabluetooth"
 
 #include <cstring>
+#include <cstdio>
 #include <cstddef>
 #include <cstdlib>
 #include <cstdbool>
 #include <cassert>
 #include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "connection.h"
 #include "log.h"
@@ -34,7 +39,13 @@
 namespace pvlib {
 
 #define HEADER_SIZE 18
+#define MAX_SEGMENTS 64
+#define MAX_DATA (0xff - HEADER_SIZE)
 #define TIMEOUT 5000
+#define SPACE_TIMEOUT 100
+#define RX_BUFFER_SIZE 4096
+#define CONNECT_TIMEOUT 5 /* in seconds */
+#define SIGNAL_INTERVAL 300 /* in seconds */
 
 static const uint8_t MAC_BROADCAST[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 static const uint8_t MAC_NULL[6] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
@@ -43,6 +54,13 @@ static const uint8_t MAC_NULL[6] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 using LockGuard = std::lock_guard<std::mutex>;
 using UniqueLock = std::unique_lock<std::mutex>;
 
+//mac in the usual notation, bytes are transmitted in reverse order
+static std::string mac_string(const uint8_t *mac) {
+	char str[18];
+	snprintf(str, sizeof(str), "%02X:%02X:%02X:%02X:%02X:%02X", mac[5], mac[4], mac[3], mac[2], mac[1], mac[0]);
+	return str;
+}
+
 static int parse_header(uint8_t *buf, Smabluetooth::Packet *packet) {
 	if (buf[0] != 0x7e) {
 		LOG(Error) << "Invalid header!";
@@ -147,13 +165,26 @@ int Smabluetooth::cmd_05(const Packet *packet) {
 
 	UniqueLock lock(mutex);
 	if (state != STATE_MAC) {
-		return 0; //ignore packet
+		return 0; //only expected while connecting, keep the nodes
+	}
+
+	//first entry is our own adapter, keep measurements of known nodes
+	std::vector<Node> list;
+	for (int i = 1; i <= num_devices; ++i) {
+		const uint8_t *entry = &packet->data[8 * i];
+		Node *known = findNode(entry);
+		Node node = (known != nullptr) ? *known : Node{ {}, {}, -1, {} };
+		memcpy(node.mac, entry, 6);
+		memcpy(node.type, entry + 6, 2);
+		list.push_back(node);
 	}
+	nodes = std::move(list);
+
 	this->num_devices = num_devices;
 	state = STATE_DEVICE_LIST;
 	lock.unlock();
 
-	event.notify_all();
+	finishConnect(0);
 
 	return 0;
 }
@@ -169,10 +200,29 @@ int Smabluetooth::cmd_04(const Packet *packet) {
 
 	LOG(Trace) << "Got command 04";
 
-	mutex.lock();
-	signalStrength = packet->data[4] * 100 / 0xff;
-	events |= EVENT_SIGNAL_STRENGTH;
-	mutex.unlock();
+	LockGuard lock(mutex);
+	//only the connected device answers keepalives
+	if (memcmp(packet->mac_src, mac_inv, 6) == 0 && keepaliveOpen.exchange(false)) {
+		keptAlive.store(true);
+	}
+
+	std::string src(reinterpret_cast<const char*>(packet->mac_src), 6);
+	auto it = std::find(queried.begin(), queried.end(), src);
+	if (it == queried.end()) {
+		if (queried.size() != 1 || findNode(packet->mac_src) != nullptr) {
+			LOG(Debug) << "Ignoring unexpected signal strength answer";
+			return 0;
+		}
+		it = queried.begin(); //answered by relay, only one query open
+	}
+
+	Node *node = findNode(reinterpret_cast<const uint8_t*>(it->data()));
+	if (node != nullptr) {
+		node->signal = packet->data[4] * 100 / 0xff;
+		node->measured = std::chrono::steady_clock::now();
+		LOG(Info) << "Signal strength of " << mac_string(node->mac) << ": " << node->signal;
+	}
+	queried.erase(it);
 
 	event.notify_all();
 
@@ -200,154 +250,446 @@ int Smabluetooth::packet_event(const Packet *packet) {
 	return 0;
 }
 
-//read requested number of bytes
-//if we got null bytes and timeout return 0
-//if we got bytes but not requested size return -1
-static int read_complete_len(Connection *con, uint8_t *data, int len, int timeout) {
-	int ret = 0;
-	int pos = 0;
+//returns < 0 if thread should quit, > 0 if the queue is full and parsing has to stop
+int Smabluetooth::queue(Received &&received) {
+	bool waited = false;
 
-	do {
-		if ((ret = con->read(data + pos, len)) < 0) {
-			return -1;
+	while (!packets.push(std::move(received))) {
+		if (!backpressure) {
+			++dropped;
+			LOG(Warning) << "Receive queue full, dropping packet!";
+			return 0;
 		}
-		len -= ret;
-		pos += ret;
 
-		if (ret == 0 && pos != 0) {
-			return -1; //we got part of data and then timeout
+		//inline the reader is blocked by us, the frame is queued again once it popped
+		if (inlineMode) {
+			if (!rxStalled) {
+				++stalled;
+				LOG(Debug) << "Receive queue full, parsing continues on next read";
+			}
+			return 1;
 		}
 
-	} while (pos != 0 && len > 0);
+		//stop reading until the reader caught up, the link buffers meanwhile
+		if (!waited) {
+			++stalled;
+			waited = true;
+			LOG(Debug) << "Receive queue full, waiting for reader";
+		}
+		if (quit.load()) {
+			return -1;
+		}
+		packets.waitSpace(SPACE_TIMEOUT);
+	}
 
-	return pos;
+	size_t size = packets.size();
+	size_t high = highWatermark.load(std::memory_order_relaxed);
+	if (size > high) {
+		highWatermark.store(size, std::memory_order_relaxed);
+	}
+
+	return 0;
 }
 
-void Smabluetooth::worker_thread() {
-	uint8_t buf[HEADER_SIZE];
+//handle one complete frame, header already parsed into packet
+int Smabluetooth::dispatch(const Frame &frame, Packet *packet) {
+	//no lock required for sma->mac, only we(this thread) change it.
+	bool for_us = (memcmp(packet->mac_dst, mac, 6) == 0) || (memcmp(packet->mac_dst, MAC_NULL, 6) == 0)
+			|| (memcmp(packet->mac_dst, MAC_BROADCAST, 6) == 0);
+
+	if (((packet->cmd == 0x01) || (packet->cmd == 0x08)) && for_us) {
+		Received received;
+		memcpy(received.mac_src, packet->mac_src, 6);
+		received.cmd = packet->cmd;
+		received.data = frame.slice(HEADER_SIZE, packet->len);
+
+		LOG(Trace) << "received smadata2plus packet:\n" << print_array(received.data.data(), packet->len);
+		return queue(std::move(received));
+	} else {
+		memcpy(packet->data, frame.data() + HEADER_SIZE, packet->len);
+		LOG(Trace) << "received non smadata2plus packet:\n" << print_array(packet->data, packet->len);
+
+		if (for_us) {
+			return packet_event(packet);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parse all complete frames between rxPos and rxFill. Frames are handed on
+ * as slices of rxBuf. If the queue is full inline with backpressure the
+ * rest stays in rxBuf, rxStalled is set and parsing resumes on the next call.
+ */
+int Smabluetooth::parse() {
 	Packet packet;
 	int ret;
-	bool for_us;
-
-	while (!quit.load()) {
-		ret = read_complete_len(con, buf, HEADER_SIZE, TIMEOUT);
 
-		if (ret < 0) {
-			goto error;
-		} else if (ret == 0) {
-			continue;
+	while (rxFill - rxPos >= HEADER_SIZE) {
+		if (parse_header(rxBuf.data() + rxPos, &packet) < 0) {
+			return -1;
 		}
 
-		if (parse_header(buf, &packet) < 0) {
-			goto error;
+		int len = HEADER_SIZE + packet.len;
+		if (rxFill - rxPos < len) {
+			break; //wait for rest of frame
 		}
 
-		if ((ret = read_complete_len(con, packet.data, packet.len, TIMEOUT)) < 0) {
-			goto error;
+		if ((ret = dispatch(rxBuf.slice(rxPos, len), &packet)) < 0) {
+			return -1;
+		} else if (ret > 0) {
+			rxStalled = true;
+			return 0;
 		}
+		rxStalled = false;
+		rxPos += len;
+	}
 
-		//LOG_DEBUG("Got header");
+	if (rxPos == rxFill && rxBuf.unique()) {
+		rxPos = rxFill = 0;
+	}
 
-		//no lock required for sma->mac, only we(this thread) change it.
-		for_us = (memcmp(packet.mac_dst, mac, 6) == 0) || (memcmp(packet.mac_dst, MAC_NULL, 6) == 0)
-				|| (memcmp(packet.mac_dst, MAC_BROADCAST, 6) == 0);
+	return 0;
+}
 
-		if (((packet.cmd == 0x01) || (packet.cmd == 0x08)) && for_us) {
-			LOG(Trace) << "received smadata2plus packet:\n" << print_array(packet.data, packet.len);
-			mutex.lock();
-			if (packets.size() >= MAX_PACKETS_SIZE) { //remove old packets
-				packets.pop();
-			}
-			packets.push(packet);
-			mutex.unlock();
+/*
+ * Reads as much as available into rxBuf and parses all complete frames in one pass.
+ * Frames are handed on as slices of rxBuf, so it is only written behind rxFill
+ * and replaced by a new one if it runs full while slices are still in use.
+ *
+ * Returns < 0 on error, else number of bytes read.
+ */
+int Smabluetooth::receive() {
+	using Clock = std::chrono::steady_clock;
+	int ret;
+
+	//the reader might have made room for frames left by a stall
+	if (rxStalled && parse() < 0) {
+		return -1;
+	}
 
-			event.notify_all();
+	//keep room for a maximal frame
+	if (rxBuf.size() - rxFill < 0xff) {
+		int left = rxFill - rxPos;
+		if (rxBuf.unique()) {
+			memmove(rxBuf.data(), rxBuf.data() + rxPos, left);
 		} else {
-			LOG(Trace) << "received non smadata2plus packet:\n" << print_array(packet.data, packet.len);
+			Frame next = Frame::alloc(RX_BUFFER_SIZE);
+			memcpy(next.data(), rxBuf.data() + rxPos, left);
+			rxBuf = std::move(next);
+		}
+		rxPos = 0;
+		rxFill = left;
+	}
+	if (rxFill == rxBuf.size()) {
+		return 0; //stalled with a full buffer, the link buffers meanwhile
+	}
 
-			if (for_us) {
-				if (packet_event(&packet) < 0) {
-					goto error;
-				}
-			}
+	if ((ret = con->read(rxBuf.data() + rxFill, rxBuf.size() - rxFill)) < 0) {
+		return -1;
+	} else if (ret == 0) {
+		if (!rxStalled && rxFill > rxPos && Clock::now() - rxLast > std::chrono::milliseconds(TIMEOUT)) {
+			LOG(Error) << "Incomplete frame!";
+			return -1;
 		}
+		return 0;
 	}
+	rxFill += ret;
+	rxLast = Clock::now();
+	touch();
+
+	if (!rxStalled && parse() < 0) {
+		return -1;
+	}
+
+	return ret;
+}
 
-	return;
+//handshake deadline passed
+bool Smabluetooth::connectTimedOut() {
+	if (connectPending.load() && std::chrono::steady_clock::now() > connectDeadline) {
+		LOG(Error) << "Connection timeout!";
+		return true;
+	}
+	return false;
+}
 
-error:
+void Smabluetooth::fail() {
 	mutex.lock();
 	state = STATE_ERROR;
 	mutex.unlock();
 
+	online.store(false);
+	packets.wake();
+	finishConnect(-1);
 }
 
-Smabluetooth::Smabluetooth(Connection *con) :
+//ms until the next receive deadline, -1 if there is none
+int Smabluetooth::receiveTimeout() {
+	using namespace std::chrono;
+	steady_clock::time_point deadline = steady_clock::time_point::max();
+
+	if (connectPending.load()) {
+		deadline = connectDeadline;
+	}
+	if (rxFill > rxPos) {
+		deadline = std::min(deadline, rxLast + milliseconds(TIMEOUT));
+	}
+	int interval = keepaliveInterval.load();
+	if (interval > 0 && online.load()) {
+		steady_clock::time_point last(steady_clock::duration(lastTraffic.load()));
+		deadline = std::min(deadline, last + seconds(interval));
+	}
+	if (!inlineMode && online.load()) {
+		deadline = std::min(deadline, nextSignalProbe);
+	}
+
+	if (deadline == steady_clock::time_point::max()) {
+		return -1;
+	}
+	auto left = duration_cast<milliseconds>(deadline - steady_clock::now()).count() + 1;
+	return static_cast<int>(std::max<decltype(left)>(left, 0));
+}
+
+/*
+ * Block until the connection has data, wake is signalled or timeout ms passed.
+ * Connections without fd are polled by their read timeout instead.
+ */
+int Smabluetooth::waitReadable(int timeout) {
+	int fd = con->readFd();
+
+	++wakeups;
+	if (fd < 0) {
+		return 1;
+	}
+
+	struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+	int ret = poll(pfd, (wakeFd >= 0) ? 2 : 1, timeout);
+	if (ret < 0) {
+		if (errno == EINTR) return 0;
+		LOG(Error) << "poll failed: " << strerror(errno);
+		return -1;
+	}
+
+	if (ret > 0 && pfd[1].revents != 0) {
+		drainWakeFd();
+	}
+	return ret;
+}
+
+//reset wakeFd, it is non blocking so EAGAIN means it was not signalled
+void Smabluetooth::drainWakeFd() {
+	uint64_t count;
+	if (::read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		LOG(Warning) << "Failed resetting wakeup: " << strerror(errno);
+	}
+}
+
+void Smabluetooth::worker_thread() {
+	while (!quit.load()) {
+		if (connectTimedOut() || waitReadable(receiveTimeout()) < 0) {
+			fail();
+			return;
+		}
+		if (quit.load()) {
+			return;
+		}
+		keepalive();
+		refreshSignal();
+		if (receive() < 0) {
+			fail();
+			return;
+		}
+	}
+}
+
+//wait until pred is true, inline the waiting thread does the receiving
+template<typename Predicate>
+bool Smabluetooth::waitUntil(UniqueLock &lock, std::chrono::steady_clock::time_point deadline, Predicate pred) {
+	if (!inlineMode) {
+		return event.wait_until(lock, deadline, pred);
+	}
+
+	while (!pred()) {
+		if (std::chrono::steady_clock::now() >= deadline) {
+			return false;
+		}
+		lock.unlock();
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (waitReadable(static_cast<int>(left.count()) + 1) < 0 || receive() < 0) {
+			fail();
+		}
+		lock.lock();
+	}
+	return true;
+}
+
+Smabluetooth::Smabluetooth(ReadWrite *con) :
 		con(con),
 		state(STATE_NOT_CONNECTED),
 		num_devices(0),
-		signalStrength(0),
-		events(0) {
+		readTimeout(TIMEOUT),
+		packets(DEFAULT_QUEUE_SIZE),
+		online(false),
+		queueSize(DEFAULT_QUEUE_SIZE),
+		backpressure(false),
+		rxPos(0),
+		rxFill(0),
+		rxStalled(false),
+		connectPending(false),
+		running(false),
+		inlineMode(false),
+		inlineConfig(false),
+		highWatermark(0),
+		dropped(0),
+		stalled(0),
+		wakeups(0),
+		interrupted(false),
+		keepaliveInterval(0),
+		lastTraffic(0),
+		keepaliveOpen(false),
+		keptAlive(false),
+		keepalives(0),
+		keepalivesMissed(0),
+		reconnectsAvoided(0) {
 	memset(mac, 0, sizeof(mac));
 	memset(mac_inv, 0, sizeof(mac_inv));
+
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 }
 
 Smabluetooth::~Smabluetooth() {
 	disconnect();
+
+	if (wakeFd >= 0) {
+		close(wakeFd);
+	}
 }
 
 int Smabluetooth::connect() {
 	disconnect();
 
-	//start thread
-	quit.store(false);
-	thread = std::thread([this] { worker_thread(); });
+	//no producer running, drop packets of a previous connection
+	partial.clear();
+	if (packets.capacity() != queueSize) {
+		packets.resize(queueSize);
+	} else {
+		packets.clear();
+	}
 
-	LOG(Info) << "Connecting to device!";
-	UniqueLock lock(mutex);
-	//Wait until we get list of all devices
-	while (state != STATE_DEVICE_LIST) {
-		if (state == STATE_ERROR) {
-			quit.store(true);
-			thread.join();
-			state = STATE_NOT_CONNECTED;
-			return -1;
-		}
+	rxBuf = Frame::alloc(RX_BUFFER_SIZE);
+	rxPos = rxFill = 0;
+	rxStalled = false;
+	rxLast = std::chrono::steady_clock::now();
+	inlineMode = inlineConfig;
 
-		if (event.wait_for(lock, std::chrono::seconds(5)) == std::cv_status::timeout) {
-			LOG(Error) << "Connection timeout!";
-			quit.store(true);
-			thread.join();
-			state = STATE_NOT_CONNECTED;
-			return -1;
-		}
-	}
-	state = STATE_CONNECTED;
+	UniqueLock lock(mutex);
+	state = STATE_NOT_CONNECTED;
+	connectResult = -1;
+	connectDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(CONNECT_TIMEOUT);
+	connectPending.store(true);
 	lock.unlock();
 
-	LOG(Info) << "Connected to device!";
+	LOG(Info) << "Connecting to device!";
+	running = true;
 
-	int signalStrength = getSignalStrength(mac_inv);
-	LOG(Info) <<"Signal strength: " << signalStrength;
+	if (inlineMode) {
+		//no thread, walk through the handshake here
+		while (connectPending.load()) {
+			if (connectTimedOut() || waitReadable(receiveTimeout()) < 0 || receive() < 0) {
+				fail();
+			}
+		}
+	} else {
+		//start thread, it walks through the handshake
+		quit.store(false);
+		thread = std::thread([this] { worker_thread(); });
+	}
 
-	return 0;
+	lock.lock();
+	event.wait(lock, [this] { return !connectPending.load(); });
+	return connectResult;
 }
 
-void Smabluetooth::disconnect() {
-	State state;
+void Smabluetooth::finishConnect(int ret) {
 	UniqueLock lock(mutex);
-	state = this->state;
+	if (!connectPending.load()) {
+		return;
+	}
+	connectPending.store(false);
+
+	if (ret == 0) {
+		state = STATE_CONNECTED;
+		keepaliveOpen.store(false);
+		keptAlive.store(false);
+		touch();
+		online.store(true);
+		LOG(Info) << "Connected to device!";
+	}
+
+	connectResult = ret;
 	lock.unlock();
+	event.notify_all();
 
-	if (state == STATE_NOT_CONNECTED) {
+	//answers are cached by cmd_04, nobody waits for them
+	if (ret == 0) {
+		nextSignalProbe = std::chrono::steady_clock::now() + std::chrono::seconds(SIGNAL_INTERVAL);
+		probeSignal();
+	}
+}
+
+void Smabluetooth::disconnect() {
+	if (!running) {
 		return;
 	}
+	running = false;
 
+	//wake up receiving thread, worker or inline reader, wherever it blocks
+	uint64_t count = 1;
+	online.store(false);
 	quit.store(true);
-	thread.join();
+	packets.wake();
+	if (wakeFd >= 0 && ::write(wakeFd, &count, sizeof(count)) < 0) {
+		LOG(Warning) << "Failed waking up receiver: " << strerror(errno);
+	}
+	con->interrupt(); //connections without fd
 
-	lock.lock();
-	state = STATE_NOT_CONNECTED;
+	if (thread.joinable()) {
+		thread.join();
+		if (wakeFd >= 0) {
+			drainWakeFd();
+		}
+	}
+
+	UniqueLock lock(mutex);
+	this->state = STATE_NOT_CONNECTED;
+	lock.unlock();
+	event.notify_all();
+
+	finishConnect(-1); //abort pending connect
+}
+
+void Smabluetooth::setInline(bool enable) {
+	inlineConfig = enable;
+}
+
+void Smabluetooth::setQueue(size_t size, bool backpressure) {
+	queueSize = std::max<size_t>(size, 1);
+	this->backpressure = backpressure;
+}
+
+Smabluetooth::QueueStats Smabluetooth::queueStats() const {
+	QueueStats stats;
+	stats.size = packets.capacity();
+	stats.highWatermark = highWatermark.load();
+	stats.dropped = dropped.load();
+	stats.stalled = stalled.load();
+	stats.wakeups = wakeups.load();
+	stats.keepalives = keepalives.load();
+	stats.keepalivesMissed = keepalivesMissed.load();
+	stats.reconnectsAvoided = reconnectsAvoided.load();
+	return stats;
 }
 
 int Smabluetooth::getDeviceNum() {
@@ -355,127 +697,407 @@ int Smabluetooth::getDeviceNum() {
 	return num_devices;
 }
 
-int Smabluetooth::writePacket(const Packet *packet)
+int Smabluetooth::send(uint8_t cmd, const uint8_t *mac_dst, const struct iovec *iov, int iovcnt)
+{
+	LockGuard lock(writeMutex);
+	return sendLocked(cmd, mac_dst, iov, iovcnt);
+}
+
+//writeMutex has to be held
+int Smabluetooth::sendLocked(uint8_t cmd, const uint8_t *mac_dst, const struct iovec *iov, int iovcnt)
 {
-	uint8_t buf[0xff];
-	uint16_t len;
+	uint8_t header[HEADER_SIZE];
+	struct iovec segments[MAX_SEGMENTS + 1];
+	int len = HEADER_SIZE;
 	int ret;
 
-	len = packet->len + HEADER_SIZE;
+	if (iovcnt > MAX_SEGMENTS) {
+		LOG(Error) << "Too many segments: " << iovcnt;
+		return -1;
+	}
+
+	for (int i = 0; i < iovcnt; ++i) {
+		len += iov[i].iov_len;
+		segments[i + 1] = iov[i];
+	}
+
 	if (len > 0xff) {
-		LOG(Error) << "Invalid data length: " << packet->len;
+		LOG(Error) << "Invalid data length: " << len - HEADER_SIZE;
 		return -1;
 	}
 
-	buf[0] = 0x7e;
-	buf[1] = (uint8_t) len;
-	buf[2] = 0x00;
-	buf[3] = buf[0] ^ buf[1] ^ buf[2];
+	header[0] = 0x7e;
+	header[1] = (uint8_t) len;
+	header[2] = 0x00;
+	header[3] = header[0] ^ header[1] ^ header[2];
 
-	memcpy(buf + 4, mac, 6);
-	memcpy(buf + 10, packet->mac_dst, 6);
+	memcpy(header + 4, mac, 6);
+	memcpy(header + 10, mac_dst, 6);
 
-	buf[16] = packet->cmd;
-	buf[17] = 0x00;
+	header[16] = cmd;
+	header[17] = 0x00;
 
-	memcpy(&buf[18], packet->data, packet->len);
+	segments[0].iov_base = header;
+	segments[0].iov_len = HEADER_SIZE;
 
-	LOG(Trace) << "smabluetooth, write:\n" << print_array(buf, len);
+	LOG(Trace) << "smabluetooth, write:\n" << print_iovec(segments, iovcnt + 1);
 
-	if ((ret = con->write(buf, len)) < 0) {
+	if ((ret = con->writev(segments, iovcnt + 1, "")) < 0) {
 		LOG(Error) << "Failed writing data.";
 		return ret;
 	}
+	touch();
+
+	//without the keepalive the device would have dropped the link by now
+	if (cmd == 0x01 && keptAlive.exchange(false)) {
+		++reconnectsAvoided;
+	}
 
 	return 0;
 }
 
+int Smabluetooth::writePacket(const Packet *packet)
+{
+	struct iovec iov = { const_cast<uint8_t*>(packet->data), packet->len };
+	return send(packet->cmd, packet->mac_dst, &iov, 1);
+}
+
 int Smabluetooth::write(const uint8_t *data, int len, const std::string &to) {
-	Packet packet;
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	return writev(&iov, 1, to);
+}
 
-	//packet.data = data;
-	packet.len = len;
-	packet.cmd = 0x01;
+int Smabluetooth::writev(const struct iovec *iov, int iovcnt, const std::string &to) {
+	const uint8_t *mac_dst = reinterpret_cast<const uint8_t*>(to.data());
+	struct iovec part[MAX_SEGMENTS];
+	size_t total = 0;
+	size_t offset = 0;
+	int seg = 0;
 
 	if (to.size() != 6) {
 		LOG(Error) << "Invalid destination: " << to;
 		return -1;
 	}
 
-	if (len > (int)sizeof(packet.data)) {
-		LOG(Error) << "Invalid data size: " << len << ", can be maximal: " << sizeof(packet.data);
-		return -1;
+	for (int i = 0; i < iovcnt; ++i) {
+		total += iov[i].iov_len;
+	}
+	if (total <= MAX_DATA) {
+		return send(0x01, mac_dst, iov, iovcnt);
+	}
+
+	//split into packets, all but the last one are sent with cmd 0x08
+	LockGuard lock(writeMutex);
+	while (total > 0) {
+		size_t size = std::min<size_t>(total, MAX_DATA);
+		size_t left = size;
+		int cnt = 0;
+
+		while (left > 0) {
+			if (offset == iov[seg].iov_len) {
+				++seg;
+				offset = 0;
+				continue;
+			}
+			if (cnt == MAX_SEGMENTS) {
+				LOG(Error) << "Too many segments: " << iovcnt;
+				return -1;
+			}
+
+			size_t len = std::min(left, iov[seg].iov_len - offset);
+			part[cnt].iov_base = static_cast<uint8_t*>(iov[seg].iov_base) + offset;
+			part[cnt].iov_len = len;
+			++cnt;
+			offset += len;
+			left -= len;
+		}
+
+		total -= size;
+		int ret = sendLocked((total > 0) ? 0x08 : 0x01, mac_dst, part, cnt);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
-	memcpy(packet.data, data, len);
-	memcpy(packet.mac_dst, to.c_str(), 6);
-	return writePacket(&packet);
+	return 0;
 }
 
-int Smabluetooth::readPacket(Packet *packet) {
-	UniqueLock lock(mutex);
+int Smabluetooth::pop(Received *received) {
+	using Clock = std::chrono::steady_clock;
 
-	if (state != STATE_CONNECTED) {
+	if (!online.load()) {
 		return -1;
 	}
 
-	while (packets.empty()) {
-		if(event.wait_for(lock, std::chrono::seconds(5)) == std::cv_status::timeout) {
+	auto deadline = Clock::now() + std::chrono::milliseconds(readTimeout.load());
+	while (!packets.pop(*received)) {
+		if (!online.load()) {
+			return -1;
+		}
+		if (interrupted.exchange(false)) {
+			return 0;
+		}
+
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+		if (left <= 0) {
 			return 0;
 		}
+		if (inlineMode) {
+			//frames left in rxBuf by backpressure come first, the queue is empty now
+			if (rxStalled) {
+				if (parse() < 0) {
+					fail();
+					return -1;
+				}
+				continue;
+			}
+			int ret = waitReadable(static_cast<int>(left));
+			if (ret < 0 || (ret > 0 && !interrupted.load() && receive() < 0)) {
+				fail();
+				return -1;
+			}
+		} else {
+			packets.wait(static_cast<int>(left));
+		}
 	}
 
-	*packet = packets.front(); packets.pop();
+	return received->data.size();
+}
+
+int Smabluetooth::readPacket(Packet *packet) {
+	Received received;
+	int ret;
+
+	if ((ret = pop(&received)) <= 0) {
+		return ret;
+	}
+
+	memcpy(packet->mac_src, received.mac_src, 6);
+	memcpy(packet->mac_dst, mac, 6);
+	memcpy(packet->data, received.data.data(), received.data.size());
+	packet->len = received.data.size();
+	packet->cmd = received.cmd;
 
 	return packet->len;
 }
 
 int Smabluetooth::read(uint8_t *data, int maxlen, std::string &from) {
-	Packet packet;
 	int ret;
 
-	if ((ret = readPacket(&packet)) <= 0) {
-		return ret;
+	//continue with rest of the current packet
+	if (partial.empty()) {
+		if ((ret = readFrame(partial, partialFrom)) <= 0) {
+			return ret;
+		}
 	}
 
-	//FIXME: data buffering do not discard left packet data
-	int dataLen = std::min(static_cast<int>(packet.len), maxlen);
-	from = std::string((char*)packet.mac_src, 6);
-	memcpy(data, packet.data, maxlen);
+	int dataLen = std::min(partial.size(), maxlen);
+	memcpy(data, partial.data(), dataLen);
+	partial.stripFront(dataLen);
+	from = partialFrom;
 
 	return dataLen;
 }
 
-int Smabluetooth::getSignalStrength(const uint8_t *mac)
-{
+int Smabluetooth::readFrame(Frame &frame, std::string &from) {
+	Received received;
+	int ret;
+
+	if (!partial.empty()) {
+		frame = std::move(partial);
+		from = partialFrom;
+		partial.clear();
+		return frame.size();
+	}
+
+	if ((ret = pop(&received)) <= 0) {
+		return ret;
+	}
+
+	from = std::string((char*)received.mac_src, 6);
+	frame = std::move(received.data);
+
+	return frame.size();
+}
+
+void Smabluetooth::interrupt() {
+	uint64_t count = 1;
+
+	interrupted.store(true);
+	packets.wake();
+	if (inlineMode && wakeFd >= 0 && ::write(wakeFd, &count, sizeof(count)) < 0) {
+		LOG(Warning) << "Failed waking up reader: " << strerror(errno);
+	}
+}
+
+void Smabluetooth::setReadTimeout(int timeout) {
+	readTimeout.store(timeout);
+}
+
+Smabluetooth::Node *Smabluetooth::findNode(const uint8_t *mac) {
+	for (Node &node : nodes) {
+		if (memcmp(node.mac, mac, 6) == 0) {
+			return &node;
+		}
+	}
+	return nullptr;
+}
+
+//register and send signal queries, answers are handled by cmd_04
+int Smabluetooth::sendSignalQueries(const std::vector<std::string> &macs) {
 	Packet packet;
 
 	UniqueLock lock(mutex);
 	if (state != STATE_CONNECTED) {
 		return -1;
 	}
-	events &= ~EVENT_SIGNAL_STRENGTH;
+	for (const std::string &mac : macs) {
+		if (std::find(queried.begin(), queried.end(), mac) == queried.end()) {
+			queried.push_back(mac);
+		}
+	}
 	lock.unlock();
 
 	packet.len = 2;
 	packet.cmd = SMABLUETOOTH_ASKSIGNAL;
-	memcpy(packet.mac_dst, mac, 6);
-
 	packet.data[0] = 0x05;
 	packet.data[1] = 0x00;
 
-	if (writePacket(&packet) < 0) {
-		return -1;
+	for (const std::string &mac : macs) {
+		memcpy(packet.mac_dst, mac.data(), 6);
+		if (writePacket(&packet) < 0) {
+			return -1;
+		}
 	}
 
-	lock.lock();
-	while (!(events & EVENT_SIGNAL_STRENGTH)) {
-		if(event.wait_for(lock, std::chrono::seconds(5)) == std::cv_status::timeout) {
-			return -1;
+	return 0;
+}
+
+void Smabluetooth::setKeepalive(int interval) {
+	keepaliveInterval.store(std::max(interval, 0));
+}
+
+void Smabluetooth::touch() {
+	lastTraffic.store(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+//send keepalive if the link was idle for the keepalive interval
+void Smabluetooth::keepalive() {
+	using namespace std::chrono;
+	int interval = keepaliveInterval.load();
+
+	if (interval <= 0 || !online.load()) {
+		return;
+	}
+	steady_clock::time_point last(steady_clock::duration(lastTraffic.load()));
+	if (steady_clock::now() - last < seconds(interval)) {
+		return;
+	}
+
+	if (keepaliveOpen.exchange(true)) {
+		++keepalivesMissed;
+		LOG(Warning) << "Keepalive of " << mac_string(mac_inv) << " not answered";
+	}
+
+	LOG(Debug) << "Sending keepalive after " << interval << " s idle";
+	++keepalives;
+	if (sendSignalQueries({ std::string(reinterpret_cast<const char*>(mac_inv), 6) }) < 0) {
+		LOG(Warning) << "Failed sending keepalive";
+		touch(); //do not retry immediately
+	}
+}
+
+//query signal strength of all nodes every SIGNAL_INTERVAL
+void Smabluetooth::refreshSignal() {
+	auto now = std::chrono::steady_clock::now();
+
+	if (!online.load() || now < nextSignalProbe) {
+		return;
+	}
+	nextSignalProbe = now + std::chrono::seconds(SIGNAL_INTERVAL);
+
+	LOG(Debug) << "Refreshing signal strengths";
+	probeSignal();
+}
+
+void Smabluetooth::probeSignal() {
+	std::vector<std::string> macs;
+
+	UniqueLock lock(mutex);
+	for (const Node &node : nodes) {
+		macs.emplace_back(reinterpret_cast<const char*>(node.mac), 6);
+	}
+	lock.unlock();
+
+	sendSignalQueries(macs);
+}
+
+//send signal queries to all macs at once and wait for the answers
+int Smabluetooth::querySignal(const std::vector<std::string> &macs) {
+	int ret = sendSignalQueries(macs);
+
+	auto open = [this, &macs] {
+		for (const std::string &mac : macs) {
+			if (std::find(queried.begin(), queried.end(), mac) != queried.end()) return true;
+		}
+		return false;
+	};
+
+	UniqueLock lock(mutex);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	if (ret == 0 && !waitUntil(lock, deadline, [&] { return !open() || state != STATE_CONNECTED; })) {
+		LOG(Warning) << "Not all nodes answered signal strength query";
+		ret = -1;
+	}
+
+	for (const std::string &mac : macs) {
+		auto it = std::find(queried.begin(), queried.end(), mac);
+		if (it != queried.end()) queried.erase(it);
+	}
+
+	return ret;
+}
+
+std::vector<Smabluetooth::Node> Smabluetooth::getNodes(int maxAge) {
+	std::vector<std::string> stale;
+	auto now = std::chrono::steady_clock::now();
+
+	UniqueLock lock(mutex);
+	if (maxAge >= 0) {
+		for (const Node &node : nodes) {
+			if (node.signal < 0 || now - node.measured >= std::chrono::seconds(maxAge)) {
+				stale.emplace_back(reinterpret_cast<const char*>(node.mac), 6);
+			}
 		}
 	}
-	events &= ~EVENT_SIGNAL_STRENGTH;
-	return signalStrength;
+	lock.unlock();
+
+	if (!stale.empty()) {
+		querySignal(stale);
+	}
+
+	lock.lock();
+	return nodes;
+}
+
+int Smabluetooth::getSignalStrength(const uint8_t *mac)
+{
+	std::string str(reinterpret_cast<const char*>(mac), 6);
+
+	UniqueLock lock(mutex);
+	if (findNode(mac) == nullptr) {
+		nodes.push_back(Node{ {}, {}, -1, {} });
+		memcpy(nodes.back().mac, mac, 6);
+	}
+	lock.unlock();
+
+	if (querySignal({ str }) < 0) {
+		return -1;
+	}
+
+	lock.lock();
+	Node *node = findNode(mac);
+	return (node != nullptr) ? node->signal : -1;
 }
 
 } //namespace pvlib {
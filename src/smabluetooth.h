@@ -26,9 +26,11 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <queue>
+#include <chrono>
+#include <vector>
 
 #include "readWrite.h"
+#include "ring.h"
 #include "utility.h"
 
 namespace pvlib {
@@ -39,13 +41,12 @@ namespace pvlib {
 #define SMABLUETOOTH_ASKSIGNAL 0x03
 #define SMABLUETOOTH_ANSWERSIGNAL 0x04
 
-class Connection;
-
 class Smabluetooth : public ReadWrite {
 public:
 	DISABLE_COPY(Smabluetooth)
 
 	static const int HEADER_SIZE = 18;
+	static const int DEFAULT_QUEUE_SIZE = 64; //< receive queue capacity in packets
 
 	struct Packet {
 		uint8_t mac_src[6];              //< source mac
@@ -62,7 +63,7 @@ public:
 	 * @param con connection used for sending and receiving data.
 	 *
 	 */
-	Smabluetooth(Connection *con);
+	Smabluetooth(ReadWrite *con);
 
 	/**
 	 * Close smabluetooth.
@@ -83,6 +84,11 @@ public:
 	 */
 	virtual int write(const uint8_t *data, int len, const std::string &to) override;
 
+	/**
+	 * Write data, the header is prepended as own segment.
+	 */
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
 	/**
 	 * Read data.
 	 * Note: Reads always one and only one smabluetooth frame.
@@ -96,13 +102,30 @@ public:
 	int readPacket(Packet *packet);
 
 	/**
-	 * Read data
+	 * Read data of the current packet.
+	 * A packet larger than maxlen is returned in pieces by following reads,
+	 * a read never spans two packets.
 	 */
 	virtual int read(uint8_t *data, int maxlen, std::string &from) override;
 
+	/**
+	 * Read data of one smabluetooth frame without copying.
+	 */
+	virtual int readFrame(Frame &frame, std::string &from) override;
+
+	/**
+	 * Set how long readPacket waits for a packet.
+	 */
+	virtual void setReadTimeout(int timeout) override;
+
+	virtual void interrupt() override;
+
 	/**
 	 * Connect to string convertet.
 	 *
+	 * The handshake runs in the worker thread, the signal strength probe
+	 * is sent after it completed and does not delay the result.
+	 *
 	 * @param sma smabluetooth handle.
 	 * @return < 0 if error occurs, else > 0.
 	 */
@@ -113,6 +136,47 @@ public:
 	 */
 	void disconnect();
 
+	struct QueueStats {
+		size_t   size;          //< capacity in packets
+		size_t   highWatermark; //< maximal number of queued packets
+		uint64_t dropped;       //< packets dropped because queue was full
+		uint64_t stalled;       //< times reading stopped because queue was full
+		uint64_t wakeups;       //< times the receiver woke up
+		uint64_t keepalives;        //< keepalive queries sent
+		uint64_t keepalivesMissed;  //< keepalive queries not answered until the next one
+		uint64_t reconnectsAvoided; //< data sent after the link was kept alive over an idle period
+	};
+
+	/**
+	 * Configure receive queue, takes effect on next connect.
+	 *
+	 * @param size capacity in packets.
+	 * @param backpressure if true stop reading the link while the queue is full,
+	 *        in inline mode received frames are kept unparsed until the reader
+	 *        made room, else newly received packets are dropped.
+	 */
+	void setQueue(size_t size, bool backpressure);
+
+	QueueStats queueStats() const;
+
+	/**
+	 * Read frames in the thread calling read, connect or getNodes instead of
+	 * an own receive thread, takes effect on next connect.
+	 * Only one thread may use smabluetooth then. One read of the link may
+	 * carry more packets than the queue holds, so use backpressure or a
+	 * queue large enough for the longest reply.
+	 */
+	void setInline(bool enable);
+
+	/**
+	 * Ask the connected device for its signal strength after the link was
+	 * idle for interval seconds, so it does not drop the connection.
+	 * Only done by the receive thread, not in inline mode.
+	 *
+	 * @param interval in seconds, 0 disables keepalive.
+	 */
+	void setKeepalive(int interval);
+
 	/**
 	 * Get number of devices in network.
 	 *
@@ -121,6 +185,25 @@ public:
 	 */
 	 int getDeviceNum();
 
+	struct Node {
+		uint8_t mac[6];
+		uint8_t type[2]; //< as reported in the device list
+		int signal;      //< 0 to 100, < 0 if not measured yet
+		std::chrono::steady_clock::time_point measured;
+	};
+
+	/**
+	 * Get all devices of the bluetooth network.
+	 *
+	 * The device list is the one received while connecting. The receive
+	 * thread refreshes the signal strengths of all nodes every 5 minutes,
+	 * not in inline mode. Signal strengths older than maxAge seconds are
+	 * queried again, all nodes concurrently.
+	 *
+	 * @param maxAge in seconds, < 0 only returns cached values.
+	 */
+	std::vector<Node> getNodes(int maxAge);
+
 	/**
 	 * Get signal strength.
 	 *
@@ -139,8 +222,57 @@ private:
 
 	int packet_event(const Packet *packet);
 
+	int send(uint8_t cmd, const uint8_t *mac_dst, const struct iovec *iov, int iovcnt);
+
+	int sendLocked(uint8_t cmd, const uint8_t *mac_dst, const struct iovec *iov, int iovcnt);
+
+	struct Received {
+		uint8_t mac_src[6];
+		uint8_t cmd;
+		Frame   data; //< slice of the received frame
+	};
+
+	int pop(Received *received);
+
+	int queue(Received &&received);
+
+	int dispatch(const Frame &frame, Packet *packet);
+
 	void worker_thread();
 
+	int receive();
+
+	int parse();
+
+	int receiveTimeout();
+
+	int waitReadable(int timeout);
+
+	void drainWakeFd();
+
+	bool connectTimedOut();
+
+	void fail();
+
+	template<typename Predicate>
+	bool waitUntil(std::unique_lock<std::mutex> &lock, std::chrono::steady_clock::time_point deadline, Predicate pred);
+
+	Node *findNode(const uint8_t *mac);
+
+	int sendSignalQueries(const std::vector<std::string> &macs);
+
+	void probeSignal();
+
+	void refreshSignal();
+
+	int querySignal(const std::vector<std::string> &macs);
+
+	void finishConnect(int ret);
+
+	void touch();
+
+	void keepalive();
+
 	enum State {
 		STATE_ERROR,
 		STATE_NOT_CONNECTED,
@@ -150,31 +282,62 @@ private:
 		STATE_CONNECTED
 	};
 
-	enum Event {
-		EVENT_NO_EVENT        = 0,
-		EVENT_STATE_CHANGE    = 1,
-		EVENT_SIGNAL_STRENGTH = 2
-	};
-
 
-	Connection *con;
+	ReadWrite *con;
 
 	State state;
 	int num_devices;
 	uint8_t mac[6];
 	uint8_t mac_inv[6];
-	int signalStrength;
+	std::vector<Node> nodes;          //< guarded by mutex
+	std::vector<std::string> queried; //< macs with signal query in flight, guarded by mutex
+	std::atomic_int readTimeout; //< in ms
 
 
 	std::mutex mutex;
+	std::mutex writeMutex; //< keeps packets and fragments of one frame together
 	std::condition_variable event;
 	std::thread thread;
 	std::atomic_bool quit;
 
-	int events;
-
-	std::queue<Packet> packets;
-	const static size_t MAX_PACKETS_SIZE = 40;
+	Frame partial; //< unread rest of packet, only used by read
+	std::string partialFrom;
+
+	//received smadata2plus packets, filled by worker thread, drained by the reader
+	Ring<Received> packets;
+	std::atomic_bool online; //< state is STATE_CONNECTED, readable without lock
+	size_t queueSize;
+	bool backpressure;
+
+	//receive buffer, only used by the receiving thread
+	Frame rxBuf;
+	int rxPos;  //< start of unparsed data
+	int rxFill; //< end of received data
+	bool rxStalled; //< frames left unparsed because the queue was full, inline only
+	std::chrono::steady_clock::time_point rxLast;
+	std::chrono::steady_clock::time_point nextSignalProbe; //< next periodic signal query
+
+	std::atomic_bool connectPending;
+	bool running;      //< worker started or inline connection open
+	bool inlineMode;   //< no worker, readers receive themselves
+	bool inlineConfig; //< inlineMode for next connect
+	int connectResult; //< guarded by mutex
+	std::chrono::steady_clock::time_point connectDeadline;
+
+	std::atomic<size_t> highWatermark;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> stalled;
+	std::atomic<uint64_t> wakeups;
+	int wakeFd; //< signalled to stop a worker blocking on the connection
+	std::atomic_bool interrupted;
+
+	std::atomic_int keepaliveInterval; //< in seconds
+	std::atomic<std::chrono::steady_clock::rep> lastTraffic;
+	std::atomic_bool keepaliveOpen; //< keepalive query not answered yet
+	std::atomic_bool keptAlive;     //< keepalive answered since last data was sent
+	std::atomic<uint64_t> keepalives;
+	std::atomic<uint64_t> keepalivesMissed;
+	std::atomic<uint64_t> reconnectsAvoided;
 };
 
 } //namespace pvlib {
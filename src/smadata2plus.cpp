@@ -33,6 +33,7 @@
 #include <fstream>
 
 #include "byte.h"
+#include "connection.h"
 #include "pvlib.h"
 #include "utility.h"
 #include "log.h"
@@ -53,6 +54,10 @@ using byte::DataWriter;
 static const uint32_t SMADATA2PLUS_BROADCAST = 0xffffffff;
 
 static const uint16_t PROTOCOL = 0x6560;
+
+/* read timeouts of the emulated stages in ms */
+static const int LINK_TIMEOUT = 5;
+static const int FRAME_TIMEOUT = 5000;
 static const unsigned int HEADER_SIZE = 24;
 
 /* ctrl */
@@ -73,7 +78,15 @@ static const uint32_t SMADATA2PLUS_SERIAL = 0x3a8b74b6;
 static const uint16_t SMADATA2PLUS_SYSID = 0x0078;
 
 static const int NUM_RETRIES = 3;
+
+/* read deadlines in ms */
+static const int DEFAULT_TIMEOUT = 5000;
+static const int DEFAULT_MIN_TIMEOUT = 100;
+static const int DEFAULT_MAX_TIMEOUT = 10000;
+static const int CLOCK_GRANULARITY = 10;
 static const uint16_t TRANSACTION_CNTR_START = 0x8000;
+static const int TRANSACTION_CNTR_POS = 22; /* in header */
+static const size_t MAX_CACHED_REQUESTS = 64;
 
 struct Packet {
 	char     src_mac[6];
@@ -256,7 +269,7 @@ static void parseRecord2(const uint8_t *buf, Record2 *r2)
 
 static void parseRecord3(const uint8_t *buf, Record3 *r3)
 {
-	memcpy(r3->data, buf, 40);
+	memcpy(r3->data, buf, sizeof(r3->data));
 }
 
 
@@ -268,7 +281,7 @@ static int parseChannelRecords(const uint8_t *buf,
 {
 	DataReader dr(buf, len);
 
-	if (len < 8) {
+	if (len < 12) {
 		LOG(Error) << "Invalid record length: " << len;
 		return -1; //invalid length
 	}
@@ -299,7 +312,7 @@ static int parseChannelRecords(const uint8_t *buf,
 	}
 
 	int rec_idx = 0;
-	for (int i = 12; i < len && rec_idx < *maxRecords; i += record_length, rec_idx++) {
+	for (int i = 12; i + (int)record_length <= len && rec_idx < *maxRecords; i += record_length, rec_idx++) {
 		Record *r = &records[rec_idx];
 
 		parseRecordHeader(buf + i, &r->header);
@@ -371,15 +384,72 @@ const Smadata2plus::Device* Smadata2plus::findDevice(uint32_t serial) const {
 	return nullptr;
 }
 
-int Smadata2plus::writeReplay(const Packet *packet, uint16_t transactionCntr)
+int Smadata2plus::readTimeout(uint32_t serial) const {
+	if (!adaptive) {
+		return timeout;
+	}
+
+	if (serial == SERIAL_BROADCAST) {
+		//wait for the slowest device
+		int rto = 0;
+		for (const Device &device : devices) {
+			if (device.roundTrip.rto == 0) {
+				return timeout;
+			}
+			rto = std::max(rto, static_cast<int>(device.roundTrip.rto));
+		}
+		return (rto > 0) ? rto : timeout;
+	}
+
+	const Device *device = findDevice(serial);
+	if (device == nullptr || device->roundTrip.rto == 0) {
+		return timeout;
+	}
+	return device->roundTrip.rto;
+}
+
+void Smadata2plus::updateRoundTrip(uint32_t serial, Clock::duration rtt) {
+	Device *device = getDevice(devices, serial);
+	if (device == nullptr) {
+		return;
+	}
+
+	RoundTrip &rt = device->roundTrip;
+	int32_t sample = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+	if (rt.srtt < 0) {
+		rt.srtt = sample;
+		rt.rttvar = sample / 2;
+	} else {
+		rt.rttvar = (3 * rt.rttvar + std::abs(rt.srtt - sample)) / 4;
+		rt.srtt = (7 * rt.srtt + sample) / 8;
+	}
+
+	int32_t rto = (rt.srtt + std::max(CLOCK_GRANULARITY * 1000, 4 * rt.rttvar)) / 1000;
+	rt.rto = std::min(std::max(rto, minTimeout), maxTimeout);
+
+	LOG(Debug) << "device " << serial << " rtt " << sample << " us, srtt " << rt.srtt
+			<< " us, rttvar " << rt.rttvar << " us, deadline " << rt.rto << " ms";
+}
+
+void Smadata2plus::backoff(uint32_t serial) {
+	for (Device &device : devices) {
+		if ((serial == SERIAL_BROADCAST || device.serial == serial) && device.roundTrip.rto != 0) {
+			device.roundTrip.rto = std::min(device.roundTrip.rto * 2, maxTimeout);
+		}
+	}
+	requestPending = false; //a late reply is no valid sample
+}
+
+int Smadata2plus::packHeader(const Packet *packet, uint16_t transactionCntr, uint8_t *buf, std::string &to) const
 {
-	uint8_t buf[511 + HEADER_SIZE];
-	uint8_t size = HEADER_SIZE;
 	char mac_dst[6];
 	DataWriter dw(buf, HEADER_SIZE);
 
-	assert(packet->len + HEADER_SIZE <= sizeof(buf));
-	assert(packet->len % 4 == 0);
+	//header counts 4 byte words
+	if (packet->len < 0 || packet->len % 4 != 0 || packet->len + HEADER_SIZE > Smanet::MAX_DATA_SIZE) {
+		LOG(Error) << "Invalid packet length: " << packet->len;
+		return -1;
+	}
 
 	memset(buf, 0x00, HEADER_SIZE);
 
@@ -415,13 +485,68 @@ int Smadata2plus::writeReplay(const Packet *packet, uint16_t transactionCntr)
 	if (packet->start)
 		buf[20] = packet->packet_num;
 
-	byte::storeU16le(&buf[22], transactionCntr);
+	byte::storeU16le(&buf[TRANSACTION_CNTR_POS], transactionCntr);
 
-	memcpy(&buf[size], packet->data, packet->len);
-	LOG(Trace) << "write smadata2plus packet:\n" << print_array(buf, packet->len + size);
+	to.assign(mac_dst, 6);
+	return 0;
+}
+
+int Smadata2plus::writeReplay(const Packet *packet, uint16_t transactionCntr)
+{
+	uint8_t buf[HEADER_SIZE];
+	std::string to;
 
-	std::string to(mac_dst, 6);
-	return smanet.write(buf, size + packet->len, to);
+	if (packHeader(packet, transactionCntr, buf, to) < 0) {
+		return -1;
+	}
+
+	struct iovec iov[2] = {
+		{ buf, HEADER_SIZE },
+		{ packet->data, static_cast<size_t>(packet->len) }
+	};
+	LOG(Trace) << "write smadata2plus packet:\n" << print_iovec(iov, 2);
+
+	requestSerial = packet->dstSerial;
+	requestTime = Clock::now();
+	requestPending = true;
+
+	return smanet.writev(iov, 2, to);
+}
+
+const Smadata2plus::Request *Smadata2plus::compileRequest(const RequestKey &key, const Packet *packet)
+{
+	uint8_t buf[HEADER_SIZE];
+	Request request;
+
+	if (packHeader(packet, 0, buf, request.to) < 0) {
+		return nullptr;
+	}
+
+	struct iovec iov[2] = {
+		{ buf, HEADER_SIZE },
+		{ packet->data, static_cast<size_t>(packet->len) }
+	};
+	if (smanet.compile(iov, 2, TRANSACTION_CNTR_POS, request.frame) < 0) {
+		return nullptr;
+	}
+	request.serial = packet->dstSerial;
+
+	//archive requests differ in their time range, keep the cache bounded
+	if (requests.size() >= MAX_CACHED_REQUESTS) {
+		requests.clear();
+	}
+	return &(requests[key] = std::move(request));
+}
+
+int Smadata2plus::writeRequest(const Request &request)
+{
+	LOG(Trace) << "write cached smadata2plus request, transaction " << transaction_cntr;
+
+	requestSerial = request.serial;
+	requestTime = Clock::now();
+	requestPending = true;
+
+	return smanet.writeTemplate(request.frame, transaction_cntr, request.to);
 }
 
 int Smadata2plus::write(const Packet *packet) {
@@ -429,21 +554,27 @@ int Smadata2plus::write(const Packet *packet) {
 }
 
 int Smadata2plus::read(Packet *packet) {
-	uint8_t buf[512 + HEADER_SIZE];
-	int size = HEADER_SIZE;
+	Frame frame;
 	int len;
 
-	assert(packet->len <= 512);
-
 	std::string src;
-	len = smanet.read(buf, packet->len + HEADER_SIZE, src);
+	smanet.setReadTimeout(readTimeout(requestSerial));
+	len = smanet.readFrame(frame, src);
+	if (len == 0) {
+		backoff(requestSerial);
+	}
 	if (len <= 0) { //handle timeout as failure
 		LOG(Error) << "smanet_read failed.";
 		return -1;
 	}
+	if (len < static_cast<int>(HEADER_SIZE)) {
+		LOG(Error) << "Invalid packet length: " << len;
+		return -1;
+	}
 	int macsize = std::min(6, (int)src.size());
 	memcpy(packet->src_mac, src.c_str(), macsize);
 
+	const uint8_t *buf = frame.data();
 	LOG(Trace) << "read smadata2plus packet:\n" << print_array(buf, len);
 
 	packet->ctrl = buf[1];
@@ -456,21 +587,29 @@ int Smadata2plus::read(Packet *packet) {
 	packet->packet_num = byte::parseU16le(buf + 20);
 	packet->transaction_cntr = byte::parseU16le(&buf[22]);
 
-	len -= HEADER_SIZE;
-	if (len < packet->len) packet->len = len;
+	if (requestPending && packet->srcSerial == requestSerial) {
+		updateRoundTrip(requestSerial, Clock::now() - requestTime);
+		requestPending = false;
+	}
 
-	memcpy(packet->data, &buf[size], packet->len);
+	//data stays in the received frame until the next read
+	frame.stripFront(HEADER_SIZE);
+	received = std::move(frame);
+	packet->data = received.data();
+	packet->len = received.size();
 
 	return 0;
 }
 
-/*
- * Request a channel.
- */
 int Smadata2plus::requestChannel(uint32_t serial, uint16_t channel, uint32_t fromIdx, uint32_t toIdx) {
+	RequestKey key = { REQUEST_CHANNEL, serial, channel, fromIdx, toIdx };
+	const Request *request = findRequest(key);
+	if (request != nullptr) {
+		return writeRequest(*request);
+	}
+
 	Packet packet;
 	uint8_t buf[12];
-	int ret;
 	DataWriter dw(buf, sizeof(buf));
 
 	memset(buf, 0x00, sizeof(buf));
@@ -489,10 +628,10 @@ int Smadata2plus::requestChannel(uint32_t serial, uint16_t channel, uint32_t fro
 	dw.u32le(fromIdx);
 	dw.u32le(toIdx);
 
-	ret = write(&packet);
-	//inc_transaction_cntr();
-
-	return ret;
+	if ((request = compileRequest(key, &packet)) == nullptr) {
+		return -1;
+	}
+	return writeRequest(*request);
 }
 
 int Smadata2plus::readRecords(uint32_t serial,
@@ -505,7 +644,6 @@ int Smadata2plus::readRecords(uint32_t serial,
 {
 	int ret = 0;
 	Packet packet;
-	uint8_t data[512];
 
 
 	//begin_transaction(sma);
@@ -517,8 +655,6 @@ int Smadata2plus::readRecords(uint32_t serial,
 	}
 
 	memset(&packet, 0x00, sizeof(packet));
-	packet.data = data;
-	packet.len = sizeof(data);
 
 	if ((ret = read(&packet)) < 0) {
 		//end_transaction(sma);
@@ -527,7 +663,7 @@ int Smadata2plus::readRecords(uint32_t serial,
 
 	//end_transaction(sma);
 
-	if ((ret = parseChannelRecords(data, packet.len, records, len, type, object)) < 0) {
+	if ((ret = parseChannelRecords(packet.data, packet.len, records, len, type, object)) < 0) {
 		LOG(Error) << "Failed parsing record of " << std::hex <<  object << " " << from_idx << " " << to_idx;
 		return ret;
 	}
@@ -537,6 +673,12 @@ int Smadata2plus::readRecords(uint32_t serial,
 
 void Smadata2plus::addDevice(uint16_t susyId, uint32_t serial, char *mac) {
 	devices.emplace_back(susyId, serial, mac, false);
+	requests.clear(); //sysId and mac are part of the requests
+}
+
+const Smadata2plus::Request *Smadata2plus::findRequest(const RequestKey &key) const {
+	auto it = requests.find(key);
+	return (it != requests.end()) ? &it->second : nullptr;
 }
 
 /*
@@ -549,24 +691,33 @@ void Smadata2plus::addDevice(uint16_t susyId, uint32_t serial, char *mac) {
 //}
 
 int Smadata2plus::logout() {
-	Packet packet;
-	uint8_t buf[8];
+	RequestKey key = { REQUEST_LOGOUT, SERIAL_BROADCAST, 0, 0, 0 };
+	const Request *request = findRequest(key);
 	int ret;
-	DataWriter dw(buf, sizeof(buf));
 
-	packet.ctrl = CTRL_MASTER;
-	packet.dstSerial = SERIAL_BROADCAST;
-	packet.flag = 0x03;
-	packet.data = buf;
-	packet.len = sizeof(buf);
-	packet.packet_num = 0;
-	packet.start = true;
+	if (request == nullptr) {
+		Packet packet;
+		uint8_t buf[8];
+		DataWriter dw(buf, sizeof(buf));
+
+		packet.ctrl = CTRL_MASTER;
+		packet.dstSerial = SERIAL_BROADCAST;
+		packet.flag = 0x03;
+		packet.data = buf;
+		packet.len = sizeof(buf);
+		packet.packet_num = 0;
+		packet.start = true;
 
-	dw.u32le(0xfffd010e);
-	dw.u32le(0xffffffff);
+		dw.u32le(0xfffd010e);
+		dw.u32le(0xffffffff);
+
+		if ((request = compileRequest(key, &packet)) == nullptr) {
+			return -1;
+		}
+	}
 
 	Transaction t(this);
-	if ((ret = write(&packet)) < 0) {
+	if ((ret = writeRequest(*request)) < 0) {
 		return ret;
 	}
 
@@ -622,8 +773,9 @@ int Smadata2plus::sendPassword(const char *password, Smadata2plus::UserType user
 
 	memset(buf, 0x00, sizeof(buf));
 
+	char timeBuf[26];
 	cur_time = time(NULL);
-	LOG(Info) << "Sending password " <<  password << " at " << ctime(&cur_time);
+	LOG(Info) << "Sending password " <<  password << " at " << ctime_r(&cur_time, timeBuf);
 
 	dw.u32le(0xfffd040c);
 	dw.u8(0x07);
@@ -671,12 +823,8 @@ int Smadata2plus::ackAuth(uint32_t serial)
  */
 int Smadata2plus::authenticate(const char *password, UserType user)
 {
-	uint8_t buf[52];
 	Packet packet;
 
-	packet.data = buf;
-	packet.len = 52;
-
 	Transaction t(this);
 
 	if (sendPassword(password, user) < 0) {
@@ -689,10 +837,15 @@ int Smadata2plus::authenticate(const char *password, UserType user)
 			return -1;
 		}
 
+		if (packet.len < 32) {
+			LOG(Error) << "Invalid authentication answer!";
+			return -1;
+		}
+
 		for (int i = 0; i < (i < 12) && (password[i] != '\0'); i++) {
 			Device *device;
 
-			if ((buf[20 + i] ^ 0x88) != password[i]) {
+			if ((packet.data[20 + i] ^ 0x88) != password[i]) {
 				LOG(Info) << "Plant authentication error, serial: " << packet.srcSerial;
 			}
 
@@ -760,15 +913,15 @@ int Smadata2plus::syncTime() {
 		return -1;
 	}
 
-	time_t last_adjusted = byte::parseU32le(buf + 20);
+	time_t last_adjusted = byte::parseU32le(packet.data + 20);
 
-	time_t inverter_time1 = byte::parseU32le(buf + 16);
-	time_t inverter_time2 = byte::parseU32le(buf + 24);
+	time_t inverter_time1 = byte::parseU32le(packet.data + 16);
+	time_t inverter_time2 = byte::parseU32le(packet.data + 24);
 
-	uint32_t tz_dst = byte::parseU32le(buf + 28);
+	uint32_t tz_dst = byte::parseU32le(packet.data + 28);
 	int tz = tz_dst & 0xfffffe;
 	int dst = tz_dst & 0x1;
-	uint32_t unknown = byte::parseU32le(buf + 32);
+	uint32_t unknown = byte::parseU32le(packet.data + 32);
 	uint16_t transaction_cntr = packet.transaction_cntr;
 
 	LOG(Info) << "Time last adjusted: " << timeString(last_adjusted, tz, dst);
@@ -870,10 +1023,18 @@ int Smadata2plus::syncTime() {
 
 Smadata2plus::Smadata2plus(Connection *con) :
 		connection(con),
-		sma(con),
-		smanet(PROTOCOL, &sma),
+		linkEmulator(Netem::fromEnv("PVLIB_NETEM_LINK", con, LINK_TIMEOUT)),
+		sma(linkEmulator ? static_cast<ReadWrite*>(linkEmulator.get()) : con),
+		frameEmulator(Netem::fromEnv("PVLIB_NETEM_FRAME", &sma, FRAME_TIMEOUT)),
+		smanet(PROTOCOL, frameEmulator ? static_cast<ReadWrite*>(frameEmulator.get()) : &sma),
 		transaction_cntr(TRANSACTION_CNTR_START),
-		transaction_active(false) {
+		transaction_active(false),
+		timeout(DEFAULT_TIMEOUT),
+		minTimeout(DEFAULT_MIN_TIMEOUT),
+		maxTimeout(DEFAULT_MAX_TIMEOUT),
+		adaptive(true),
+		requestSerial(SERIAL_BROADCAST),
+		requestPending(false) {
 
 	std::string tagFile = std::string(resources_path()) + '/' + "en_US_tags.txt";
 	if (readTags(tagFile) < 0) {
@@ -881,11 +1042,32 @@ Smadata2plus::Smadata2plus(Connection *con) :
 	}
 }
 
+Smadata2plus::~Smadata2plus() {
+	//stop the emulators before the stages they read from
+	disconnect();
+}
+
 int Smadata2plus::connect(const char *password, const void *param)
 {
 	int deviceNum;
 	int ret;
 	int cnt = 0;
+	const pvlib_smadata2plus_param *p = static_cast<const pvlib_smadata2plus_param*>(param);
+
+	timeout = (p != nullptr && p->timeout > 0) ? p->timeout : DEFAULT_TIMEOUT;
+	minTimeout = (p != nullptr && p->min_timeout > 0) ? p->min_timeout : DEFAULT_MIN_TIMEOUT;
+	maxTimeout = (p != nullptr && p->max_timeout > 0) ? p->max_timeout : DEFAULT_MAX_TIMEOUT;
+	maxTimeout = std::max(maxTimeout, minTimeout);
+	adaptive = (p == nullptr) || (p->fixed == 0);
+
+	sma.setQueue((p != nullptr && p->queue_size > 0) ? p->queue_size : Smabluetooth::DEFAULT_QUEUE_SIZE,
+			(p != nullptr) && (p->backpressure != 0));
+	sma.setInline((p != nullptr) && (p->inline_io != 0));
+	sma.setKeepalive((p != nullptr) ? p->keepalive : 0);
+
+	if (linkEmulator) linkEmulator->reset();
+	if (frameEmulator) frameEmulator->reset();
+	smanet.reset();
 
 	if ((ret = sma.connect()) < 0) {
 	    LOG(Error) << "Connecting bluetooth failed!";
@@ -1404,9 +1586,14 @@ static Smadata2plus::TotalDayData parseTotalDayData(uint8_t *buf, int len) {
 }
 
 int Smadata2plus::requestArchiveData(uint32_t serial, uint16_t obj, time_t from, time_t to) {
+	RequestKey key = { REQUEST_ARCHIVE, serial, obj, static_cast<uint32_t>(from), static_cast<uint32_t>(to) };
+	const Request *request = findRequest(key);
+	if (request != nullptr) {
+		return writeRequest(*request);
+	}
+
 	Packet packet;
 	uint8_t buf[12];
-	int ret;
 	DataWriter dw(buf, sizeof(buf));
 
 	memset(buf, 0x00, sizeof(buf));
@@ -1426,11 +1613,10 @@ int Smadata2plus::requestArchiveData(uint32_t serial, uint16_t obj, time_t from,
 	dw.u32le(from);
 	dw.u32le(to);
 
-	if ((ret = write(&packet)) < 0) {
-		return ret;
+	if ((request = compileRequest(key, &packet)) == nullptr) {
+		return -1;
 	}
-
-	return 0;
+	return writeRequest(*request);
 }
 
 int Smadata2plus::readEventData(uint32_t serial, time_t from, time_t to, UserType user, std::vector<EventData> &eventData) {
@@ -1442,12 +1628,8 @@ int Smadata2plus::readEventData(uint32_t serial, time_t from, time_t to, UserTyp
 		return ret;
 	}
 
-	uint8_t buf[512];
 	Packet packet;
 
-	packet.data = buf;
-	packet.len = sizeof(buf);
-
 	std::vector<EventData> events;
 	do {
 		if ((ret = read(&packet)) < 0)  {
@@ -1461,14 +1643,14 @@ int Smadata2plus::readEventData(uint32_t serial, time_t from, time_t to, UserTyp
 		}
 
 		//check object
-		uint16_t obj = byte::parseU16le(buf + 2);
+		uint16_t obj = byte::parseU16le(packet.data + 2);
 		if (obj != reqObj) {
 			LOG(Error) << "Unexpected object, expected: " << std::hex << reqObj << obj;
 			return -1;
 		}
 
-		uint32_t dataFrom = byte::parseU32le(buf + 4);
-		uint32_t dataTo   = byte::parseU32le(buf + 8);
+		uint32_t dataFrom = byte::parseU32le(packet.data + 4);
+		uint32_t dataTo   = byte::parseU32le(packet.data + 8);
 		int entrys = dataTo - dataFrom + 1;
 		if (entrys <= 0) {
 			LOG(Error) << "Unexpected entry number: " << entrys;
@@ -1476,7 +1658,7 @@ int Smadata2plus::readEventData(uint32_t serial, time_t from, time_t to, UserTyp
 		}
 
 		for (int i = 12; i + 48 <= packet.len && ((i - 12) / 48 < entrys); i += 48) {
-			EventData eventData = parseEventData(buf + i, 48);
+			EventData eventData = parseEventData(packet.data + i, 48);
 			if ((from <= eventData.time) && ( eventData.time <= to)) {
 				//some or all inverter ignore the from and to time stamps and
 				//return the complete event history, so filter know
@@ -1501,12 +1683,8 @@ int Smadata2plus::readTotalDayData(uint32_t serial, time_t from,
 		return ret;
 	}
 
-	uint8_t buf[512];
 	Packet packet;
 
-	packet.data = buf;
-	packet.len = sizeof(buf);
-
 	std::vector<TotalDayData> dayData;
 	do {
 		if ((ret = read(&packet)) < 0)  {
@@ -1520,14 +1698,14 @@ int Smadata2plus::readTotalDayData(uint32_t serial, time_t from,
 		}
 
 		//check object
-		uint16_t obj = byte::parseU16le(buf + 2);
+		uint16_t obj = byte::parseU16le(packet.data + 2);
 		if (obj != reqObj) {
 			LOG(Error) << "Unexpected object, expected: " <<std::hex << reqObj << obj;
 			return -1;
 		}
 
-		uint32_t dataFrom = byte::parseU32le(buf + 4);
-		uint32_t dataTo   = byte::parseU32le(buf + 8);
+		uint32_t dataFrom = byte::parseU32le(packet.data + 4);
+		uint32_t dataTo   = byte::parseU32le(packet.data + 8);
 		int entrys = dataTo - dataFrom + 1;
 		if (entrys <= 0) {
 			LOG(Error) << "Unexpected entry number: " << entrys;
@@ -1535,7 +1713,7 @@ int Smadata2plus::readTotalDayData(uint32_t serial, time_t from,
 		}
 
 		for (int i = 12; i + 12 <= packet.len && ((i - 12) / 12 < entrys); i += 12) {
-			TotalDayData day = parseTotalDayData(buf + i, 12);
+			TotalDayData day = parseTotalDayData(packet.data + i, 12);
 			if ((from <= day.time) && (day.time <= to) && (day.totalYield != PVLIB_INVALID_U64)) {
 				//some or all inverter ignore the from and to time stamps and
 				//return the complete event history, so filter know
@@ -1641,6 +1819,37 @@ int Smadata2plus::readEvents(uint32_t id, time_t from, time_t to, pvlib_event**
 	return eventData.size();
 }
 
+int Smadata2plus::readLinkStats(pvlib_link_stats *stats) {
+	Smabluetooth::QueueStats queue = sma.queueStats();
+
+	stats->queue_size = queue.size;
+	stats->high_watermark = queue.highWatermark;
+	stats->dropped = queue.dropped;
+	stats->stalled = queue.stalled;
+	stats->wakeups = queue.wakeups;
+	stats->keepalives = queue.keepalives;
+	stats->keepalives_missed = queue.keepalivesMissed;
+	stats->reconnects_avoided = queue.reconnectsAvoided;
+
+	return 0;
+}
+
+int Smadata2plus::readBluetoothNodes(pvlib_bluetooth_node *nodes, int maxNodes, int maxAge) {
+	std::vector<Smabluetooth::Node> list = sma.getNodes(maxAge);
+	auto now = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < maxNodes && i < static_cast<int>(list.size()); ++i) {
+		const Smabluetooth::Node &node = list[i];
+		memcpy(nodes[i].mac, node.mac, 6);
+		memcpy(nodes[i].type, node.type, 2);
+		nodes[i].signal = node.signal;
+		nodes[i].age = (node.signal < 0) ? -1 :
+				std::chrono::duration_cast<seconds>(now - node.measured).count();
+	}
+
+	return list.size();
+}
+
 int Smadata2plus::inverterNum() {
 	return devices.size();
 }
@@ -1695,6 +1904,11 @@ int Smadata2plus::getDevices(uint32_t* ids, int max_num) {
 
 void Smadata2plus::disconnect() {
 	sma.disconnect();
+	requests.clear();
+
+	if (frameEmulator) frameEmulator->reset();
+	if (linkEmulator) linkEmulator->reset();
+	smanet.reset();
 }
 
 static Protocol *createSmadata2plus(Connection *con) {
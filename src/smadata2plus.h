@@ -22,8 +22,13 @@
 #define SMADATA2PLUS_H
 
 #include <cstring>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <unordered_map>
 
+#include "netem.h"
 #include "protocol.h"
 #include "smabluetooth.h"
 #include "smanet.h"
@@ -46,7 +51,7 @@ public:
 
 	Smadata2plus(Connection *connection);
 
-	virtual ~Smadata2plus() {};
+	virtual ~Smadata2plus();
 
 	virtual int connect(const char *password, const void *param) override;
 
@@ -70,11 +75,27 @@ public:
 
 	virtual int readEvents(uint32_t id, time_t from, time_t to, pvlib_event **events) override;
 
+	virtual int readLinkStats(pvlib_link_stats *stats) override;
+
+	virtual int readBluetoothNodes(pvlib_bluetooth_node *nodes, int maxNodes, int maxAge) override;
+
+	/**
+	 * Round trip estimation of a device, see RFC 6298.
+	 */
+	struct RoundTrip {
+		int32_t srtt;   //< smoothed round trip time in us, < 0 if not measured
+		int32_t rttvar; //< round trip time variation in us
+		int32_t rto;    //< read deadline in ms, 0 if not measured
+
+		RoundTrip() : srtt(-1), rttvar(0), rto(0) {}
+	};
+
 	struct Device {
-		uint16_t sysId;
-		uint32_t serial;
-		char     mac[6];
-		bool     authenticated;
+		uint16_t  sysId;
+		uint32_t  serial;
+		char      mac[6];
+		bool      authenticated;
+		RoundTrip roundTrip;
 
 		Device(uint16_t sysId, uint32_t serial, const char *mac, bool authenticated) :
 				sysId(sysId),
@@ -124,12 +145,60 @@ public:
 			time_t to, std::vector<TotalDayData> &eventData);
 
 private:
+	using Clock = std::chrono::steady_clock;
+
 	const Device* findDevice(uint32_t serial) const;
 
+	int readTimeout(uint32_t serial) const;
+
+	void updateRoundTrip(uint32_t serial, Clock::duration rtt);
+
+	void backoff(uint32_t serial);
+
+	int packHeader(const Packet *packet, uint16_t transactionCntr, uint8_t *buf, std::string &to) const;
+
 	int writeReplay(const Packet *packet, uint16_t transactionCntr);
 
+	enum RequestType {
+		REQUEST_CHANNEL,
+		REQUEST_ARCHIVE,
+		REQUEST_LOGOUT
+	};
+
+	struct RequestKey {
+		RequestType type;
+		uint32_t serial;
+		uint16_t object;
+		uint32_t from;
+		uint32_t to;
+
+		bool operator<(const RequestKey &other) const {
+			return std::tie(type, serial, object, from, to) <
+					std::tie(other.type, other.serial, other.object, other.from, other.to);
+		}
+	};
+
+	/**
+	 * Prebuilt request, only the transaction counter is patched when sent.
+	 */
+	struct Request {
+		Smanet::Template frame;
+		std::string to;
+		uint32_t serial;
+	};
+
+	const Request *findRequest(const RequestKey &key) const;
+
+	const Request *compileRequest(const RequestKey &key, const Packet *packet);
+
+	int writeRequest(const Request &request);
+
 	int write(const Packet *packet);
 
+	/**
+	 * Read packet, packet->data points to the received frame afterwards
+	 * and is valid until the next read.
+	 */
 	int read(Packet *packet);
 
 	int requestChannel(uint32_t serial, uint16_t channel, uint32_t fromIdx, uint32_t toIdx);
@@ -156,12 +225,28 @@ private:
 	int readTags(const std::string& file);
 
 	Connection *connection;
+	std::unique_ptr<Netem> linkEmulator;  //< between connection and smabluetooth
 	Smabluetooth sma;
+	std::unique_ptr<Netem> frameEmulator; //< between smabluetooth and smanet
 	Smanet smanet;
+	Frame received; //< last packet read
+
+	std::map<RequestKey, Request> requests; //< cleared when devices change
 
 	uint16_t transaction_cntr; // Packet counter
 	bool transaction_active;
 
+	/* read deadlines in ms */
+	int timeout;
+	int minTimeout;
+	int maxTimeout;
+	bool adaptive;
+
+	/* last request, a first reply to it is a round trip sample */
+	uint32_t requestSerial;
+	Clock::time_point requestTime;
+	bool requestPending;
+
 	std::vector<Device> devices;
 
 	struct Tag {
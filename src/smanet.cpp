@@ -24,58 +24,16 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <vector>
+
+#include "fcs.h"
+#include "hdlc.h"
 #include "log.h"
 #include "smanet.h"
 
 namespace pvlib {
 
-static const uint32_t ACCM = 0x000E0000;
-static const uint8_t HDLC_ESC  = 0x7d;
-static const uint8_t HDLC_SYNC = 0x7e;
-
-static const uint16_t PPPINITFCS16 = 0xffff;
-static const uint16_t PPPGOODFCS16 = 0xf0b8;
-
-static const int FRAME_SIZE = 512 + 16;
-
-static const uint16_t fcstab[256] = { 0x0000, 0x1189, 0x2312, 0x329b, 0x4624,
-		0x57ad, 0x6536, 0x74bf, 0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5,
-		0xe97e, 0xf8f7, 0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7,
-		0x643e, 0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-		0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd, 0xad4a,
-		0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5, 0x3183, 0x200a,
-		0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c, 0xbdcb, 0xac42, 0x9ed9,
-		0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974, 0x4204, 0x538d, 0x6116, 0x709f,
-		0x0420, 0x15a9, 0x2732, 0x36bb, 0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868,
-		0x99e1, 0xab7a, 0xbaf3, 0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528,
-		0x37b3, 0x263a, 0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb,
-		0xaa72, 0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-		0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1, 0x7387,
-		0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738, 0xffcf, 0xee46,
-		0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70, 0x8408, 0x9581, 0xa71a,
-		0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7, 0x0840, 0x19c9, 0x2b52, 0x3adb,
-		0x4e64, 0x5fed, 0x6d76, 0x7cff, 0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad,
-		0xc324, 0xf1bf, 0xe036, 0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c,
-		0x7df7, 0x6c7e, 0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c,
-		0xd1b5, 0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-		0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134, 0x39c3,
-		0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c, 0xc60c, 0xd785,
-		0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3, 0x4a44, 0x5bcd, 0x6956,
-		0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb, 0xd68d, 0xc704, 0xf59f, 0xe416,
-		0x90a9, 0x8120, 0xb3bb, 0xa232, 0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1,
-		0x0d68, 0x3ff3, 0x2e7a, 0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3,
-		0x8238, 0x93b1, 0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70,
-		0x1ff9, 0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-		0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-static uint16_t fcsCalc(uint16_t fcs, const uint8_t* buf, int len)
-{
-	while (len--) {
-		fcs = (uint16_t)((fcs >> 8) ^ fcstab[(fcs ^ *buf++) & 0xff]);
-	}
-	return fcs;
-}
+static const size_t MAX_SEGMENTS = 32;
 
 static int addHdlc(const uint8_t *in, uint8_t *out, uint8_t len)
 {
@@ -103,125 +61,252 @@ static int addHdlc(const uint8_t *in, uint8_t *out, uint8_t len)
 	return pos;
 }
 
-static int validateFrame(uint8_t *frame, uint16_t len)
-{
-	if (len > FRAME_SIZE) {
-		return -1;
-	}
-
-	if (fcsCalc(PPPINITFCS16, frame, len) != PPPGOODFCS16) {
-		return -1;
-	}
-
-	return 0;
-}
-
 Smanet::Smanet(uint16_t protocol, ReadWrite *con) :
 		protocol(protocol),
 		con(con),
-		size(0) {
+		deframer(FRAME_SIZE) {
+
+}
 
+void Smanet::reset()
+{
+	deframer.reset();
+	pending.clear();
+	partial.clear();
 }
 
 int Smanet::read(uint8_t *data, int len, std::string &from)
 {
-	uint8_t buf[FRAME_SIZE];
-	uint16_t i = 0;
-	uint16_t pos = 0;
-	uint8_t sync = 0;
+	int ret;
 
 	if (len <= 0) return 0;
 
+	//continue with rest of the current frame
+	if (partial.empty()) {
+		if ((ret = readFrame(partial, partialFrom)) <= 0) {
+			return ret;
+		}
+	}
+
+	len = (partial.size() < len) ? partial.size() : len;
+	memcpy(data, partial.data(), len);
+	partial.stripFront(len);
+	from = partialFrom;
+	return len;
+}
+
+int Smanet::readFrame(Frame &frame, std::string &from)
+{
+	Frame raw;
+
+	if (!partial.empty()) {
+		frame = std::move(partial);
+		from = partialFrom;
+		partial.clear();
+		return frame.size();
+	}
 
-	for (i = 0; (i < FRAME_SIZE) && !sync; i++) {
-		// add last byte to new buffer, because it could be a HDLC_ESC
-		if (((pos + 1 == size) && (read_buf[pos] != HDLC_SYNC)) || pos >= size) {
-			if (pos >= size) {
-				size = con->read(read_buf, BUF_SIZE, from);
-				if (size < 0) return -1;
-			} else {
-				read_buf[0] = read_buf[size - 1];
-				size = con->read(read_buf + 1, BUF_SIZE - 1, from);
-				if (size < 0) return -1;
-				size++;
+	for (;;) {
+		if (pending.empty()) {
+			int ret = con->readFrame(pending, pendingFrom);
+			if (ret <= 0) {
+				pending.clear();
+				return ret; //error or no data available
 			}
-			pos = 0;
 		}
 
-		//check if no data available
-		if (size == 0) {
-			return 0;
+		//frames may span several smabluetooth frames or share one
+		int ret = deframer.next(pending, raw);
+		if (ret < 0) {
+			return -1;
+		} else if (ret > 0) {
+			break;
 		}
+	}
 
-		switch (read_buf[pos]) {
-		case HDLC_ESC:
-			pos++;
-			buf[i] = read_buf[pos++] ^ 0x20;
-			break;
-		case HDLC_SYNC:
-			if (i == 0) {
-				//remove all HDLC_SYNC bytes, because emtpy frames are allowed.
-				while ((pos < size) && (read_buf[pos] == HDLC_SYNC))
-					pos++;
-				i--;
-			} else {
-				i--;
-				size = size - pos;
-				memmove(read_buf, read_buf + pos, size);
-				sync = 1; //success
-			}
-			break;
-		default:
-			buf[i] = read_buf[pos++];
-			break;
+	from = pendingFrom;
+
+	if (raw.size() < 4) return -1;
+
+	// header (4 bytes), FCS is already removed
+	frame = raw.slice(4, raw.size() - 4);
+	return frame.size();
+}
+
+int Smanet::write(const uint8_t *data, int len, const std::string &to)
+{
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	return writev(&iov, 1, to);
+}
+
+//escape sequences for all bytes, segments point into it
+static const struct EscapeTable {
+	uint8_t sequence[256][2];
+
+	EscapeTable() {
+		for (int i = 0; i < 256; ++i) {
+			sequence[i][0] = HDLC_ESC;
+			sequence[i][1] = i ^ 0x20;
 		}
 	}
+} escapeTable;
 
-	if (!sync) {
-		LOG(Error) << "Failed: frame to big!";
-		return -1;
+//add data as segments, escaped bytes are replaced by their escape sequence
+static void addHdlcSegments(std::vector<struct iovec> &out, const uint8_t *data, size_t len)
+{
+	size_t start = 0;
+
+	for (size_t i = hdlcFindEscape(data, len); i < len; i = start + hdlcFindEscape(data + start, len - start)) {
+		if (i > start) {
+			out.push_back({ const_cast<uint8_t*>(data + start), i - start });
+		}
+		out.push_back({ const_cast<uint8_t*>(escapeTable.sequence[data[i]]), 2 });
+		start = i + 1;
+	}
+
+	if (len > start) {
+		out.push_back({ const_cast<uint8_t*>(data + start), len - start });
 	}
+}
+
+int Smanet::writev(const struct iovec *iov, int iovcnt, const std::string &to)
+{
+	uint8_t header[5];
+	uint8_t head[1 + 2 * 4];
+	uint8_t tail[2 * 2 + 1];
+	uint16_t fcs;
+	size_t len = 0;
+	int pos = 0;
 
-	if (validateFrame(buf, i) < 0) {
-		LOG(Error) << "Invalid frame!";
+	for (int i = 0; i < iovcnt; ++i) {
+		len += iov[i].iov_len;
+	}
+	if (len > MAX_DATA_SIZE) {
+		LOG(Error) << "Invalid data length: " << len;
 		return -1;
 	}
 
-	if (i < 4) return -1;
+	header[0] = 0xff;
+	header[1] = 0x03;
+	header[2] = protocol & 0xff;
+	header[3] = (protocol >> 8) & 0xff;
 
-	i -= 6; // header (4 bytes) + FCS (2 bytes)
-	len = (i < len) ? i : len;
+	head[pos++] = HDLC_SYNC;
+	pos += addHdlc(header, &head[pos], 4);
 
-	memcpy(data, &buf[4], len);
-	return len;
+	std::vector<struct iovec> out;
+	out.reserve(iovcnt + 8);
+	out.push_back({ head, static_cast<size_t>(pos) });
+
+	fcs = fcs16(PPPINITFCS16, header, 4);
+	for (int i = 0; i < iovcnt; ++i) {
+		const uint8_t *data = static_cast<const uint8_t*>(iov[i].iov_base);
+		fcs = fcs16(fcs, data, iov[i].iov_len);
+		addHdlcSegments(out, data, iov[i].iov_len);
+	}
+	fcs ^= 0xffff; /* complement */
+
+	//the fcs is escaped as well
+	header[0] = fcs & 0x00ff;
+	header[1] = (fcs >> 8) & 0x00ff;
+	pos = addHdlc(header, tail, 2);
+	tail[pos++] = HDLC_SYNC;
+	out.push_back({ tail, static_cast<size_t>(pos) });
+
+	if (out.size() > MAX_SEGMENTS) {
+		//too fragmented, copy to one buffer
+		std::vector<uint8_t> buf;
+		for (const struct iovec &v : out) {
+			const uint8_t *data = static_cast<const uint8_t*>(v.iov_base);
+			buf.insert(buf.end(), data, data + v.iov_len);
+		}
+		return con->write(buf.data(), buf.size(), to);
+	}
+
+	return con->writev(out.data(), out.size(), to);
 }
 
-int Smanet::write(const uint8_t *data, int len, const std::string &to)
+static void appendHdlc(std::vector<uint8_t> &out, const uint8_t *data, size_t len)
 {
-	uint8_t buf[FRAME_SIZE];
-	uint16_t fcs;
-	uint16_t pos = 0;
+	std::vector<struct iovec> segments;
+	addHdlcSegments(segments, data, len);
+	for (const struct iovec &v : segments) {
+		const uint8_t *seg = static_cast<const uint8_t*>(v.iov_base);
+		out.insert(out.end(), seg, seg + v.iov_len);
+	}
+}
 
-	assert(len < 256);
+int Smanet::compile(const struct iovec *iov, int iovcnt, size_t field, Template &tmpl) const
+{
+	std::vector<uint8_t> data;
+	uint8_t header[4];
 
-	buf[pos++] = 0x7e;
-	buf[pos++] = 0xff;
-	buf[pos++] = 0x03;
-	buf[pos++] = protocol & 0xff;
-	buf[pos++] = (protocol >> 8) & 0xff;
+	for (int i = 0; i < iovcnt; ++i) {
+		const uint8_t *seg = static_cast<const uint8_t*>(iov[i].iov_base);
+		data.insert(data.end(), seg, seg + iov[i].iov_len);
+	}
+	if (data.size() > MAX_DATA_SIZE || field + 2 > data.size()) {
+		LOG(Error) << "Invalid template, data length: " << data.size() << ", field: " << field;
+		return -1;
+	}
 
-	fcs = fcsCalc(PPPINITFCS16, &buf[1], 4);
-	fcs = fcsCalc(fcs, data, len);
+	header[0] = 0xff;
+	header[1] = 0x03;
+	header[2] = protocol & 0xff;
+	header[3] = (protocol >> 8) & 0xff;
+
+	tmpl.head.assign(1, HDLC_SYNC);
+	appendHdlc(tmpl.head, header, sizeof(header));
+	appendHdlc(tmpl.head, data.data(), field);
+	tmpl.tail.clear();
+	appendHdlc(tmpl.tail, data.data() + field + 2, data.size() - field - 2);
+
+	data[field] = data[field + 1] = 0;
+	tmpl.fcs = fcs16(fcs16(PPPINITFCS16, header, sizeof(header)), data.data(), data.size());
+
+	//the fcs is linear, each field bit changes it by the fcs of the bit followed by the zeroed rest
+	std::vector<uint8_t> zeros(data.size() - field - 2, 0);
+	for (int i = 0; i < 16; ++i) {
+		uint8_t bit[2] = { static_cast<uint8_t>((1 << i) & 0xff), static_cast<uint8_t>((1 << i) >> 8) };
+		tmpl.fieldFcs[i] = fcs16(fcs16(0, bit, sizeof(bit)), zeros.data(), zeros.size());
+	}
+
+	return 0;
+}
+
+int Smanet::writeTemplate(const Template &tmpl, uint16_t value, const std::string &to)
+{
+	uint8_t buf[2];
+	uint8_t field[2 * 2];
+	uint8_t tail[2 * 2 + 1];
+	uint16_t fcs = tmpl.fcs;
+	int fieldLen;
+	int pos;
+
+	for (int i = 0; i < 16; ++i) {
+		if (value & (1 << i)) {
+			fcs ^= tmpl.fieldFcs[i];
+		}
+	}
 	fcs ^= 0xffff; /* complement */
 
-	//FIXME: length check!!!
-	pos += addHdlc(data, &buf[5], len);
+	buf[0] = value & 0x00ff;
+	buf[1] = (value >> 8) & 0x00ff;
+	fieldLen = addHdlc(buf, field, 2);
+
+	buf[0] = fcs & 0x00ff;
+	buf[1] = (fcs >> 8) & 0x00ff;
+	pos = addHdlc(buf, tail, 2);
+	tail[pos++] = HDLC_SYNC;
 
-	buf[pos++] = fcs & 0x00ff;
-	buf[pos++] = (fcs >> 8) & 0x00ff;
-	buf[pos++] = 0x7e;
+	struct iovec out[4] = {
+		{ const_cast<uint8_t*>(tmpl.head.data()), tmpl.head.size() },
+		{ field, static_cast<size_t>(fieldLen) },
+		{ const_cast<uint8_t*>(tmpl.tail.data()), tmpl.tail.size() },
+		{ tail, static_cast<size_t>(pos) }
+	};
 
-	return con->write(buf, pos, to);
+	return con->writev(out, 4, to);
 }
 
 } //namespace pvlib {
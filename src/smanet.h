@@ -22,7 +22,9 @@
 #define SMANET_H
 
 #include <cstdint>
+#include <vector>
 
+#include "hdlc.h"
 #include "readWrite.h"
 
 namespace pvlib {
@@ -32,6 +34,9 @@ class Smanet : public ReadWrite {
 public:
 	DISABLE_COPY(Smanet)
 
+	static const int FRAME_SIZE = 512 + 16;         //< maximal unescaped frame including header and FCS
+	static const int MAX_DATA_SIZE = FRAME_SIZE - 6; //< maximal data of one frame
+
 	/**
 	 * Setup smanet.
 	 *
@@ -61,11 +66,20 @@ public:
 	 */
 	virtual int write(const uint8_t *data, int len, const std::string &to) override;
 
+	/**
+	 * Write data gathered from segments.
+	 * Runs not needing escaping are passed on as segments of the caller's
+	 * buffers, only escape sequences, header and FCS are added.
+	 *
+	 * @return < 0 if data is larger than MAX_DATA_SIZE or writing failed.
+	 */
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
 	/**
 	 * Read data.
-	 * Note: Reads always one and only one smabluetooth frame.
-	 * If given size is below smabluetooth frame size left bytes will be removed.
-	 * If given size greater than smabluetooth frame size only size of frame will be read.
+	 * Note: Reads never span two smanet frames.
+	 * If given size is below frame size the rest is returned by following reads.
+	 * If given size greater than frame size only size of frame will be read.
 	 * So allways check return size!
 	 *
 	 * @param smanet smanet handle.
@@ -78,14 +92,55 @@ public:
 	 */
 	virtual int read(uint8_t *data, int len, std::string &from) override;
 
-private:
-	int readFrame(uint8_t *data, int len, std::string &from);
+	/**
+	 * Read data of one smanet frame without copying.
+	 * Frames are unescaped in place, only frames spanning several
+	 * smabluetooth frames are copied together. Unescaping and FCS check
+	 * are done in one pass.
+	 */
+	virtual int readFrame(Frame &frame, std::string &from) override;
+
+	/**
+	 * Prebuilt frame whose data only differs in a 16 bit little endian field.
+	 */
+	struct Template {
+		std::vector<uint8_t> head; //< escaped frame up to the field
+		std::vector<uint8_t> tail; //< escaped data after the field
+		uint16_t fcs;              //< FCS register with field 0
+		uint16_t fieldFcs[16];     //< FCS change of each field bit
+	};
 
-	static constexpr int BUF_SIZE = 255;
+	/**
+	 * Build template of the frame writev would send for data.
+	 *
+	 * @param field offset of the field in data.
+	 * @return < 0 if data is too large or field is not inside.
+	 */
+	int compile(const struct iovec *iov, int iovcnt, size_t field, Template &tmpl) const;
+
+	/**
+	 * Write template with field set to value.
+	 * Only field and FCS are escaped, the FCS is patched per set bit.
+	 */
+	int writeTemplate(const Template &tmpl, uint16_t value, const std::string &to);
+
+	virtual void setReadTimeout(int timeout) override {
+		con->setReadTimeout(timeout);
+	}
+
+	/**
+	 * Drop a frame in progress and unread data, e.g. of a previous connection.
+	 */
+	void reset();
+
+private:
 	uint16_t protocol;
 	ReadWrite *con;
-	uint8_t read_buf[BUF_SIZE];
-	uint8_t size;
+	HdlcDeframer deframer;
+	Frame pending; //< received data not yet parsed
+	std::string pendingFrom;
+	Frame partial; //< unread rest of frame, only used by read
+	std::string partialFrom;
 };
 
 } //namespace pvlib {
@@ -0,0 +1,247 @@
+/*
+ *   Pvlib - Socket connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define PVLIB_LOG_MODULE "socket"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "connection.h"
+#include "log.h"
+#include "pvlib.h"
+#include "socket.h"
+
+namespace pvlib {
+
+const static int TIMEOUT = 5; /* in milliseconds */
+
+//must be set before connect, else tcp window scaling ignores it
+static void setReceiveBuffer(int s, int rcvbuf) {
+	if (rcvbuf > 0 && setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+		LOG(Warning) << "Failed setting SO_RCVBUF: " << strerror(errno);
+	}
+}
+
+Socket::Socket() :
+		connected(false),
+		timeout(TIMEOUT),
+		socket(-1) {
+
+}
+
+Socket::~Socket() {
+	if (connected) {
+		disconnect();
+	}
+}
+
+int Socket::connectTcp(const std::string &address, int rcvbuf, bool nodelay) {
+	struct addrinfo hints;
+	struct addrinfo *result;
+	int s = -1;
+
+	size_t sep = address.rfind(':');
+	if (sep == std::string::npos || sep + 1 >= address.size()) {
+		LOG(Error) << "Invalid address, expected host:port: " << address;
+		return -1;
+	}
+
+	std::string host = address.substr(0, sep);
+	std::string port = address.substr(sep + 1);
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+		host = host.substr(1, host.size() - 2); //ipv6 literal
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+	if (ret != 0) {
+		LOG(Error) << "Failed resolving " << address << ": " << gai_strerror(ret);
+		return -1;
+	}
+
+	for (struct addrinfo *ai = result; ai != nullptr; ai = ai->ai_next) {
+		s = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0) {
+			continue;
+		}
+
+		setReceiveBuffer(s, rcvbuf);
+		if (::connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(result);
+
+	if (s < 0) {
+		LOG(Error) << "Failed connecting to " << address << ": " << strerror(errno);
+		return -1;
+	}
+
+	int flag = nodelay ? 1 : 0;
+	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
+		LOG(Warning) << "Failed setting TCP_NODELAY: " << strerror(errno);
+	}
+
+	return s;
+}
+
+int Socket::connectUnix(const std::string &path, int rcvbuf) {
+	struct sockaddr_un addr;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		LOG(Error) << "Unix socket path too long: " << path;
+		return -1;
+	}
+
+	int s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		LOG(Error) << "Failed opening unix socket: " << strerror(errno);
+		return -1;
+	}
+
+	setReceiveBuffer(s, rcvbuf);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (::connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		LOG(Error) << "Failed connecting to " << path << ": " << strerror(errno);
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int Socket::connect(const char *address, const void *param) {
+	const pvlib_socket_param *p = static_cast<const pvlib_socket_param*>(param);
+	int rcvbuf = (p != nullptr) ? p->rcvbuf : 0;
+	bool nodelay = (p != nullptr) ? (p->nodelay != 0) : true;
+	int s;
+
+	if (connected) {
+		disconnect();
+	}
+
+	if (address == nullptr || address[0] == '\0') {
+		LOG(Error) << "No address given!";
+		return -1;
+	}
+
+	std::string addr(address);
+	if (addr.compare(0, 5, "unix:") == 0) {
+		s = connectUnix(addr.substr(5), rcvbuf);
+	} else if (addr[0] == '/' || addr[0] == '.') {
+		s = connectUnix(addr, rcvbuf);
+	} else {
+		s = connectTcp(addr, rcvbuf, nodelay);
+	}
+
+	if (s < 0) {
+		return -1;
+	}
+
+	socket = s;
+	connected = true;
+	LOG(Info) << "Socket: Successfully established connection to " << address;
+	return 0;
+}
+
+int Socket::write(const uint8_t *data, int len, const std::string& to)
+{
+	struct iovec iov = { const_cast<uint8_t*>(data), static_cast<size_t>(len) };
+	return writev(&iov, 1, to);
+}
+
+int Socket::writev(const struct iovec *iov, int iovcnt, const std::string& to)
+{
+	int ret = sendAll(socket, iov, iovcnt);
+	if (ret < 0) {
+		LOG(Error) << "Error writing data: " << strerror(errno);
+	}
+	return ret;
+}
+
+int Socket::read(uint8_t *data, int max_len, std::string& from)
+{
+	struct timeval tv;
+	fd_set rdfds;
+	int s;
+
+	s = socket;
+
+	FD_ZERO(&rdfds);
+	FD_SET(s, &rdfds);
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if (select(s + 1, &rdfds, NULL, NULL, &tv) < 0) {
+		LOG(Error) << "socket select error!";
+		return -1;
+	}
+
+	if (FD_ISSET(s, &rdfds)) {
+		int ret;
+		ret = recv(s, data, max_len, 0);
+		if (ret < 0) {
+			LOG(Error) << "Error reading data: " << strerror(errno);
+			return -1;
+		} else if (ret == 0) {
+			LOG(Error) << "Connection closed by gateway!";
+			return -1;
+		}
+		return ret;
+	} else {
+		return 0;
+	}
+}
+
+void Socket::disconnect() {
+	if (connected) {
+		close(socket);
+		socket = -1;
+		connected = false;
+	}
+}
+
+static Connection *createSocket() {
+	return new Socket();
+}
+
+extern const ConnectionInfo socketConnectionInfo;
+const ConnectionInfo socketConnectionInfo(createSocket, "socket", "pvlogdev,", "tcp or unix socket to a bluetooth gateway");
+
+} //namespace pvlib {
@@ -0,0 +1,65 @@
+/*
+ *   Pvlib - Socket connection
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include "connection.h"
+#include "utility.h"
+
+namespace pvlib {
+
+/**
+ * Stream socket connection to a gateway relaying the smabluetooth byte stream.
+ *
+ * Address is either host:port for tcp or the path of a unix domain socket.
+ */
+class Socket : public Connection {
+public:
+	DISABLE_COPY(Socket)
+
+	Socket();
+
+	virtual ~Socket() override;
+
+	virtual int connect(const char *address, const void *param) override;
+
+	virtual void disconnect() override;
+
+	virtual int write(const uint8_t *data, int len, const std::string &to) override;
+
+	virtual int writev(const struct iovec *iov, int iovcnt, const std::string &to) override;
+
+	virtual int read(uint8_t *data, int max_len, std::string& from) override;
+
+	virtual int readFd() const override { return connected ? socket : -1; }
+private:
+	int connectTcp(const std::string &address, int rcvbuf, bool nodelay);
+
+	int connectUnix(const std::string &path, int rcvbuf);
+
+	bool connected;
+	int timeout;
+	int socket;
+};
+
+} //namespace pvlib {
+
+#endif /* #ifndef SOCKET_H */
@@ -22,6 +22,11 @@
 
 #include <cstdlib>
 #include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "config.h"
 
@@ -36,13 +41,68 @@ const char *resources_path() {
 	}
 }
 
-//FIXME: not reentrant
 std::string timeString(time_t time, int tz, bool dst) {
 	time_t tmp = time + tz + static_cast<int>(dst) * 3600;
-	std::tm* nowTm= std::gmtime(&tmp);
+	std::tm nowTm;
 	char buf[42];
-	std::strftime(buf, 42, "%Y-%m-%d %X", nowTm);
+	gmtime_r(&tmp, &nowTm);
+	std::strftime(buf, 42, "%Y-%m-%d %X", &nowTm);
 	return buf;
 }
 
+//skip segments transferred completely, returns false if all are done
+static bool advance(std::vector<struct iovec> &vec, size_t &idx, size_t done) {
+	while (idx < vec.size() && done >= vec[idx].iov_len) {
+		done -= vec[idx].iov_len;
+		idx++;
+	}
+	if (idx < vec.size()) {
+		vec[idx].iov_base = static_cast<uint8_t*>(vec[idx].iov_base) + done;
+		vec[idx].iov_len -= done;
+		return true;
+	}
+	return false;
+}
+
+int sendAll(int s, const struct iovec *iov, int iovcnt) {
+	std::vector<struct iovec> vec(iov, iov + iovcnt);
+	struct msghdr msg;
+	size_t idx = 0;
+	int sent = 0;
+
+	while (idx < vec.size()) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &vec[idx];
+		msg.msg_iovlen = vec.size() - idx;
+
+		ssize_t ret = sendmsg(s, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		sent += ret;
+		advance(vec, idx, ret);
+	}
+
+	return sent;
+}
+
+int writeAll(int fd, const struct iovec *iov, int iovcnt) {
+	std::vector<struct iovec> vec(iov, iov + iovcnt);
+	size_t idx = 0;
+	int written = 0;
+
+	while (idx < vec.size()) {
+		ssize_t ret = ::writev(fd, &vec[idx], vec.size() - idx);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		written += ret;
+		advance(vec, idx, ret);
+	}
+
+	return written;
+}
+
 } //namespace pvlib {
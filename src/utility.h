@@ -22,6 +22,7 @@
 #define UTILITY_H
 
 #include <string>
+#include <sys/uio.h>
 
 #define DISABLE_COPY(CLASS) \
 	CLASS(const CLASS&) = delete; \
@@ -35,6 +36,20 @@ namespace pvlib {
 const char *resources_path();
 
 std::string timeString(time_t time, int tz, bool dst);
+
+/**
+ * Send all segments on socket s, retrying on partial writes.
+ *
+ * @return bytes sent, < 0 on error with errno set.
+ */
+int sendAll(int s, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write all segments to fd, which need not be a socket, retrying on partial writes.
+ *
+ * @return bytes written, < 0 on error with errno set.
+ */
+int writeAll(int fd, const struct iovec *iov, int iovcnt);
 }
 
 #endif /* #ifndef UTILITY_H */
@@ -0,0 +1,217 @@
+/*
+ *   Pvlib - HDLC scan kernel benchmark
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+/*
+ * Compares throughput of the HDLC scan kernels (scalar, sse2, avx2, neon,
+ * whatever the cpu supports) for finding bytes to escape, finding control
+ * bytes and unescaping frames. Results of every kernel are checked bit
+ * exact against the scalar byte loops first.
+ *
+ * usage: hdlcbench [iterations], ctest runs it with few iterations.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "hdlc.h"
+
+using namespace pvlib;
+
+static const size_t FRAME_SIZE = 528; /* maximal unescaped smanet frame */
+static const int FRAMES = 64;
+
+struct Data {
+	const char *name;
+	std::vector<uint8_t> buf; //< FRAMES frames of FRAME_SIZE, escaped
+};
+
+//frames with roughly one byte per density bytes needing escaping, 0 for none
+static Data makeData(const char *name, int density, std::mt19937 &rng) {
+	static const uint8_t special[] = { 0x11, 0x12, 0x13, HDLC_ESC, HDLC_SYNC };
+	Data data;
+	data.name = name;
+
+	for (size_t i = 0; i < FRAME_SIZE * FRAMES; ++i) {
+		uint8_t c;
+		if (density > 0 && rng() % density == 0) {
+			c = special[rng() % sizeof(special)];
+		} else {
+			do {
+				c = static_cast<uint8_t>(rng());
+			} while (hdlcNeedsEscape(c));
+		}
+
+		//escape like the sender, so the buffer can be unescaped
+		if (hdlcNeedsEscape(c)) {
+			data.buf.push_back(HDLC_ESC);
+			c ^= 0x20;
+		}
+		data.buf.push_back(c);
+	}
+
+	return data;
+}
+
+static size_t findEscapeRef(const uint8_t *data, size_t len) {
+	size_t i = 0;
+	while (i < len && !hdlcNeedsEscape(data[i])) ++i;
+	return i;
+}
+
+static size_t findControlRef(const uint8_t *data, size_t len) {
+	size_t i = 0;
+	while (i < len && data[i] != HDLC_ESC && data[i] != HDLC_SYNC) ++i;
+	return i;
+}
+
+//byte wise unescaping as done before the kernels
+static size_t unescapeRef(const uint8_t *in, size_t len, uint8_t *out) {
+	size_t pos = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (in[i] == HDLC_ESC && i + 1 < len) {
+			out[pos++] = in[++i] ^ 0x20;
+		} else {
+			out[pos++] = in[i];
+		}
+	}
+	return pos;
+}
+
+//unescaping as HdlcDeframer does it, runs between escapes are copied at once
+static size_t unescape(const HdlcKernel &kernel, const uint8_t *in, size_t len, uint8_t *out) {
+	size_t pos = 0;
+	size_t i = 0;
+	while (i < len) {
+		size_t run = kernel.findControl(in + i, len - i);
+		memcpy(out + pos, in + i, run);
+		pos += run;
+		i += run;
+		if (i >= len) {
+			break;
+		}
+		if (in[i] == HDLC_ESC && i + 1 < len) {
+			out[pos++] = in[i + 1] ^ 0x20;
+			i += 2;
+		} else {
+			out[pos++] = in[i++];
+		}
+	}
+	return pos;
+}
+
+//sum of all positions found while walking through the buffer
+static size_t scan(size_t (*find)(const uint8_t*, size_t), const std::vector<uint8_t> &buf) {
+	size_t sum = 0;
+	for (size_t i = 0; i < buf.size(); i += FRAME_SIZE) {
+		size_t len = std::min(FRAME_SIZE, buf.size() - i);
+		for (size_t pos = 0; pos < len; ++pos) {
+			pos += find(buf.data() + i + pos, len - pos);
+			sum += pos;
+		}
+	}
+	return sum;
+}
+
+static bool verify(const HdlcKernel &kernel, const Data &data) {
+	const std::vector<uint8_t> &buf = data.buf;
+
+	//every offset and length within the first frames
+	for (size_t start = 0; start < 2 * FRAME_SIZE; start += 3) {
+		for (size_t len = 0; start + len <= 2 * FRAME_SIZE; len += 17) {
+			if (kernel.findEscape(&buf[start], len) != findEscapeRef(&buf[start], len) ||
+					kernel.findControl(&buf[start], len) != findControlRef(&buf[start], len)) {
+				fprintf(stderr, "%s: %s scan differs from scalar loop at %zu+%zu\n",
+						kernel.name, data.name, start, len);
+				return false;
+			}
+		}
+	}
+
+	std::vector<uint8_t> ref(buf.size());
+	std::vector<uint8_t> out(buf.size());
+	size_t refLen = unescapeRef(buf.data(), buf.size(), ref.data());
+	size_t outLen = unescape(kernel, buf.data(), buf.size(), out.data());
+	if (refLen != outLen || memcmp(ref.data(), out.data(), refLen) != 0) {
+		fprintf(stderr, "%s: %s unescaping differs from scalar loop\n", kernel.name, data.name);
+		return false;
+	}
+
+	return true;
+}
+
+template<typename Func>
+static double throughput(size_t bytes, int iterations, Func func) {
+	using namespace std::chrono;
+	volatile size_t sink = 0;
+
+	auto start = steady_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		sink = sink + func();
+	}
+	double s = duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+	return (s > 0) ? bytes * static_cast<double>(iterations) / s / 1e9 : 0;
+}
+
+int main(int argc, char **argv) {
+	int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+	std::mt19937 rng(42);
+	std::vector<Data> datasets;
+	std::vector<uint8_t> out;
+	bool ok = true;
+
+	datasets.push_back(makeData("clean", 0, rng));
+	datasets.push_back(makeData("1/256", 256, rng));
+	datasets.push_back(makeData("1/16", 16, rng));
+
+	std::vector<HdlcKernel> kernels = hdlcKernels();
+
+	printf("%-8s %-6s %12s %12s %12s\n", "kernel", "data", "escape GB/s", "control GB/s", "unesc GB/s");
+	for (const Data &data : datasets) {
+		const std::vector<uint8_t> &buf = data.buf;
+		out.resize(buf.size());
+
+		for (const HdlcKernel &kernel : kernels) {
+			if (!verify(kernel, data)) {
+				ok = false;
+				continue;
+			}
+
+			double esc = throughput(buf.size(), iterations, [&] { return scan(kernel.findEscape, buf); });
+			double ctl = throughput(buf.size(), iterations, [&] { return scan(kernel.findControl, buf); });
+			double une = throughput(buf.size(), iterations, [&] {
+				return unescape(kernel, buf.data(), buf.size(), out.data());
+			});
+			printf("%-8s %-6s %12.2f %12.2f %12.2f\n", kernel.name, data.name, esc, ctl, une);
+		}
+
+		double une = throughput(buf.size(), iterations, [&] { return unescapeRef(buf.data(), buf.size(), out.data()); });
+		printf("%-8s %-6s %12s %12s %12.2f\n", "byte", data.name, "-", "-", une);
+	}
+
+	printf("active kernel: %s\n", hdlcKernel());
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
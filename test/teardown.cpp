@@ -0,0 +1,210 @@
+/*
+ *   Pvlib - Teardown latency test
+ *
+ *   Copyright (C) 2017 pvlogdev@gmail.com
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+/*
+ * Times pvlib_close after an idle connection, threaded and inline.
+ * A blocked reader has to be woken up, not left to run into its read
+ * timeout (5 s).
+ *
+ * The simulated plant has no fd, its reads return after a few ms anyway.
+ * The socket connection is run against a gateway in this process, which
+ * relays to a simulated plant, so the receiver blocks in poll on the fd
+ * like with rfcomm or serial.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pvlib.h"
+#include "simulation.h"
+
+static const int IDLE = 200;       /* in ms */
+static const double MAX_TEARDOWN = 100; /* in ms */
+
+/*
+ * Unix socket gateway, relays one client to a simulated plant until the
+ * client closes. After the handshake the plant stays silent.
+ */
+class Gateway {
+public:
+	Gateway() : listenFd(-1) {}
+
+	~Gateway() {
+		join();
+		if (listenFd >= 0) close(listenFd);
+		if (!path.empty()) unlink(path.c_str());
+	}
+
+	int start() {
+		struct sockaddr_un addr;
+
+		path = "/tmp/pvlib-teardown-" + std::to_string(getpid());
+		unlink(path.c_str());
+
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenFd < 0) {
+			return -1;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenFd, 1) < 0) {
+			return -1;
+		}
+
+		thread = std::thread([this] { relay(); });
+		return 0;
+	}
+
+	//wakes up accept if the client never connected
+	void join() {
+		shutdown(listenFd, SHUT_RDWR);
+		if (thread.joinable()) thread.join();
+	}
+
+	std::string address() const {
+		return "unix:" + path;
+	}
+
+private:
+	void relay() {
+		pvlib::Simulation plant;
+		uint8_t buf[1024];
+		std::string from;
+
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd < 0) {
+			return;
+		}
+		plant.setReadTimeout(1);
+		if (plant.connect("1", NULL) < 0) {
+			close(fd);
+			return;
+		}
+
+		for (;;) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 1) > 0) {
+				ssize_t len = ::read(fd, buf, sizeof(buf));
+				if (len <= 0) {
+					break; //client closed
+				}
+				plant.write(buf, static_cast<int>(len), "");
+			}
+
+			int len = plant.read(buf, sizeof(buf), from);
+			if (len > 0 && ::write(fd, buf, len) != len) {
+				break;
+			}
+		}
+
+		plant.disconnect();
+		close(fd);
+	}
+
+	std::string path;
+	int listenFd;
+	std::thread thread;
+};
+
+static int find(int num, uint32_t *handles, const char *(*name)(uint32_t), const char *wanted) {
+	for (int i = 0; i < num; ++i) {
+		if (strcmp(name(handles[i]), wanted) == 0) {
+			return handles[i];
+		}
+	}
+	return -1;
+}
+
+static int measure(const char *connection, const char *address, bool inlineIo) {
+	using namespace std::chrono;
+	uint32_t cons[10];
+	uint32_t prots[10];
+	pvlib_smadata2plus_param param;
+
+	int con = find(pvlib_connections(cons, 10), cons, pvlib_connection_name, connection);
+	int prot = find(pvlib_protocols(prots, 10), prots, pvlib_protocol_name, "smadata2plus");
+	if (con < 0 || prot < 0) {
+		fprintf(stderr, "%s connection or smadata2plus protocol not available!\n", connection);
+		return -1;
+	}
+
+	pvlib_plant *plant = pvlib_open(con, prot, NULL, NULL);
+	if (plant == NULL) {
+		fprintf(stderr, "Failed opening plant!\n");
+		return -1;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.inline_io = inlineIo;
+	if (pvlib_connect(plant, address, "0000", NULL, &param) < 0) {
+		fprintf(stderr, "Failed connecting with plant!\n");
+		pvlib_close(plant);
+		return -1;
+	}
+
+	std::this_thread::sleep_for(milliseconds(IDLE));
+
+	auto start = steady_clock::now();
+	pvlib_close(plant);
+	double ms = duration_cast<microseconds>(steady_clock::now() - start).count() / 1000.0;
+
+	printf("%s %s: pvlib_close took %.3f ms\n", connection, inlineIo ? "inline" : "threaded", ms);
+	if (ms > MAX_TEARDOWN) {
+		fprintf(stderr, "teardown took longer than %.0f ms!\n", MAX_TEARDOWN);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main() {
+	int ret = 0;
+
+	pvlib_init(NULL, NULL, PVLIB_LOG_ERROR);
+
+	if (measure("sim", "1", false) < 0) ret = -1;
+	if (measure("sim", "1", true) < 0) ret = -1;
+
+	for (bool inlineIo : { false, true }) {
+		Gateway gateway;
+		if (gateway.start() < 0) {
+			fprintf(stderr, "Failed starting gateway: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (measure("socket", gateway.address().c_str(), inlineIo) < 0) ret = -1;
+		gateway.join();
+	}
+
+	pvlib_shutdown();
+
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}